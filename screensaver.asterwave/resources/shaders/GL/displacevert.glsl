@@ -0,0 +1,80 @@
+// The #version line, the #defines of the variant and lighting.glsl are
+// put in front by CScreensaverAsterwave::Start()
+
+// Attributes
+in vec2 a_cell;  // i, j of the grid point
+in vec4 a_color;
+
+// Uniforms
+uniform mat4 u_projectionMatrix;
+uniform mat4 u_modelViewMatrix;
+uniform mat3 u_transposeAdjointModelViewMatrix;
+layout(std140) uniform Lighting
+{
+  Light u_light0;
+  Material u_material;
+};
+uniform sampler2D u_heightMap;
+uniform vec4 u_grid;         // xmin, ymin, distance between grid points along x and y
+uniform vec2 u_gridSize;     // xdivs, ydivs
+uniform float u_normalSpread; // spread of WaterNormalParams
+uniform float u_heightBlend;  // blend from the heights before the last step to the latest
+
+// Varyings
+#if defined(VERTEX_LIGHTING)
+out vec4 v_lightColor;
+#else
+out vec4 v_ambientAndEmission;
+out vec3 v_normal;
+out vec3 v_light0Vector;
+out vec3 v_light0HalfVector;
+#endif
+smooth out vec4 v_frontColor;
+out vec2 v_texCoord0;
+
+// Shader variables
+vec4 vertexPositionInEye;
+
+// The height map holds one texel per grid point with row i of the
+// field in row i of the texture, cell has to lie inside the field.
+// Red is the latest height and blue the one before the last step,
+// which the heights uploaded from the CPU leave at 0 with a blend of 1.
+float heightAt(vec2 cell)
+{
+  vec4 texel = texture(u_heightMap, (cell.yx + 0.5) / u_gridSize.yx);
+  return mix(texel.b, texel.r, u_heightBlend);
+}
+
+// Same as WaterNormalRowClamped, the points are clamped into the field
+vec3 calcNormal(vec2 cell)
+{
+  float s = u_normalSpread;
+  vec2 last = u_gridSize - 1.0;
+  float mi = max(cell.x - s, 0.0);
+  float ni = min(cell.x + s, last.x);
+  float mj = max(cell.y - s, 0.0);
+  float nj = min(cell.y + s, last.y);
+  float p = heightAt(vec2(mi, cell.y));
+  vec3 a = vec3((ni - mi) * u_grid.z, (mj - cell.y) * u_grid.w, heightAt(vec2(ni, mj)) - p);
+  vec3 b = vec3((ni - mi) * u_grid.z, (nj - cell.y) * u_grid.w, heightAt(vec2(ni, nj)) - p);
+  return normalize(cross(a, b));
+}
+
+void main ()
+{
+  vec3 normal = calcNormal(a_cell);
+  vec4 position = vec4(u_grid.xy + a_cell * u_grid.zw, heightAt(a_cell), 1.0);
+
+  vertexPositionInEye = u_modelViewMatrix * position;
+  gl_Position = u_projectionMatrix * vertexPositionInEye;
+  v_frontColor = a_color;
+  v_texCoord0 = a_cell / u_gridSize + 0.5 * normal.xy;
+
+#if defined(VERTEX_LIGHTING)
+  v_lightColor = calcPerVertexLighting(u_light0, u_material, vertexPositionInEye.xyz, normalize(u_transposeAdjointModelViewMatrix * normal));
+#else
+  v_normal = u_transposeAdjointModelViewMatrix * normal;
+  calcLightingVaryingsForFragmentShader(u_light0, u_material, vertexPositionInEye.xyz,
+                                        v_ambientAndEmission, v_light0Vector, v_light0HalfVector);
+#endif
+}
@@ -1,4 +1,5 @@
-#version 150
+// The #version line and the #defines of the variant are put in front
+// by CScreensaverAsterwave::Start()
 
 // Structs
 struct Light {
@@ -28,21 +29,29 @@ struct Material {
 };
 
 // Uniforms
-uniform Light u_light0;
-uniform Material u_material;
+layout(std140) uniform Lighting
+{
+  Light u_light0;
+  Material u_material;
+};
 uniform sampler2D u_texUnit;
 uniform int u_textureId;
 
 // Varyings
-smooth in vec4 v_frontColor;
+#if defined(VERTEX_LIGHTING)
+in vec4 v_lightColor;
+#else
 in vec3 v_normal;
 in vec4 v_ambientAndEmission;
 in vec3 v_light0Vector;
 in vec3 v_light0HalfVector;
+#endif
+smooth in vec4 v_frontColor;
 in vec2 v_texCoord0;
 
 out vec4 fragColor;
 
+#if !defined(VERTEX_LIGHTING)
 float calcSpotFactor(Light light, vec3 lightVector)
 {
   float spotFactor = dot(normalize(-lightVector), normalize(light.spotDirection));
@@ -111,6 +120,9 @@ vec4 calcPointLight(Light light, Material material, vec3 normal, vec3 lightVecto
 
 vec4 calcLight(Light light, Material material, vec3 normal, vec3 lightVector, vec3 halfVector)
 {
+#if defined(POINT_LIGHT)
+  return calcPointLight(light, material, normal, lightVector, halfVector);
+#else
   vec4 color;
   if (light.position.w != 0.0)
   {
@@ -123,6 +135,7 @@ vec4 calcLight(Light light, Material material, vec3 normal, vec3 lightVector, ve
     color = calcDirectionalLight(light, material, normal, lightVector, halfVector);
 
   return color;
+#endif
 }
 
 vec4 calcPerFragmentLighting()
@@ -135,11 +148,24 @@ vec4 calcPerFragmentLighting()
 
   return clamp(color, 0.0, 1.0);
 }
+#endif
 
 void main()
 {
+#if defined(VERTEX_LIGHTING)
+  vec4 light = v_lightColor;
+#else
+  vec4 light = calcPerFragmentLighting();
+#endif
+
+#if defined(TEXTURED)
+  // u_textureId is 0 when no image could be loaded, the water is then
+  // drawn in its lit colors
   if (u_textureId != 0)
-    fragColor = calcPerFragmentLighting() * texture(u_texUnit, v_texCoord0);
+    fragColor = light * texture(u_texUnit, v_texCoord0);
   else
-    fragColor = calcPerFragmentLighting() * v_frontColor;
+    fragColor = light * v_frontColor;
+#else
+  fragColor = light * v_frontColor;
+#endif
 }
@@ -0,0 +1,38 @@
+#version 150
+
+// Normals of the water, see WaterNormalRowClamped. Every texel gets the
+// height, previous height and the x and y of the unit normal of one
+// cell for the renderers on the CPU, which work out the z of the normal
+// as it always points up.
+
+// Uniforms
+uniform sampler2D u_state;
+uniform vec2 u_gridSize;  // xdivs, ydivs
+uniform vec2 u_divDist;   // distance between the rows and between the cells of a row
+uniform float u_spread;
+
+out vec4 fragColor;
+
+// Row i of the field is row i of the state texture
+float heightAt(vec2 cell)
+{
+  return texelFetch(u_state, ivec2(cell.yx), 0).x;
+}
+
+void main()
+{
+  vec2 cell = floor(gl_FragCoord.yx);
+  float s = u_spread;
+  vec2 last = u_gridSize - 1.0;
+  float mi = max(cell.x - s, 0.0);
+  float ni = min(cell.x + s, last.x);
+  float mj = max(cell.y - s, 0.0);
+  float nj = min(cell.y + s, last.y);
+  float p = heightAt(vec2(mi, cell.y));
+  vec3 a = vec3((ni - mi) * u_divDist.x, (mj - cell.y) * u_divDist.y, heightAt(vec2(ni, mj)) - p);
+  vec3 b = vec3((ni - mi) * u_divDist.x, (nj - cell.y) * u_divDist.y, heightAt(vec2(ni, nj)) - p);
+  vec3 normal = normalize(cross(a, b));
+
+  vec4 state = texelFetch(u_state, ivec2(cell.yx), 0);
+  fragColor = vec4(state.x, state.z, normal.xy);
+}
@@ -0,0 +1,12 @@
+#version 150
+
+// Full screen quad over the water state texture
+in vec2 a_position;
+
+out vec2 v_coord;
+
+void main()
+{
+  gl_Position = vec4(a_position, 0.0, 1.0);
+  v_coord = a_position * 0.5 + 0.5;
+}
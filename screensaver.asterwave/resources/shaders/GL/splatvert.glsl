@@ -0,0 +1,20 @@
+#version 150
+
+// One point per stamp of an effect on the water state texture
+
+// Attributes
+in vec2 a_cell;  // j, i
+in vec2 a_splat; // weight, height
+
+// Uniforms
+uniform vec2 u_texel;
+
+// Varyings
+out vec2 v_splat;
+
+void main()
+{
+  gl_Position = vec4((a_cell + 0.5) * u_texel * 2.0 - 1.0, 0.0, 1.0);
+  gl_PointSize = 1.0;
+  v_splat = a_splat;
+}
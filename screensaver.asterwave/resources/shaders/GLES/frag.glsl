@@ -1,4 +1,5 @@
-#version 100
+// The #version line and the #defines of the variant are put in front
+// by CScreensaverAsterwave::Start()
 
 precision mediump float;
 
@@ -36,13 +37,18 @@ uniform sampler2D u_texUnit;
 uniform int u_textureId;
 
 // Varyings
-varying vec4 v_frontColor;
+#if defined(VERTEX_LIGHTING)
+varying vec4 v_lightColor;
+#else
 varying vec3 v_normal;
 varying vec4 v_ambientAndEmission;
 varying vec3 v_light0Vector;
 varying vec3 v_light0HalfVector;
+#endif
+varying vec4 v_frontColor;
 varying vec2 v_texCoord0;
 
+#if !defined(VERTEX_LIGHTING)
 float calcSpotFactor(Light light, vec3 lightVector)
 {
   float spotFactor = dot(normalize(-lightVector), normalize(light.spotDirection));
@@ -111,6 +117,9 @@ vec4 calcPointLight(Light light, Material material, vec3 normal, vec3 lightVecto
 
 vec4 calcLight(Light light, Material material, vec3 normal, vec3 lightVector, vec3 halfVector)
 {
+#if defined(POINT_LIGHT)
+  return calcPointLight(light, material, normal, lightVector, halfVector);
+#else
   vec4 color;
   if (light.position.w != 0.0)
   {
@@ -123,6 +132,7 @@ vec4 calcLight(Light light, Material material, vec3 normal, vec3 lightVector, ve
     color = calcDirectionalLight(light, material, normal, lightVector, halfVector);
 
   return color;
+#endif
 }
 
 vec4 calcPerFragmentLighting()
@@ -135,11 +145,24 @@ vec4 calcPerFragmentLighting()
 
   return clamp(color, 0.0, 1.0);
 }
+#endif
 
 void main()
 {
+#if defined(VERTEX_LIGHTING)
+  vec4 light = v_lightColor;
+#else
+  vec4 light = calcPerFragmentLighting();
+#endif
+
+#if defined(TEXTURED)
+  // u_textureId is 0 when no image could be loaded, the water is then
+  // drawn in its lit colors
   if (u_textureId != 0)
-    gl_FragColor = calcPerFragmentLighting() * texture2D(u_texUnit, v_texCoord0);
+    gl_FragColor = light * texture2D(u_texUnit, v_texCoord0);
   else
-    gl_FragColor = calcPerFragmentLighting() * v_frontColor;
+    gl_FragColor = light * v_frontColor;
+#else
+  gl_FragColor = light * v_frontColor;
+#endif
 }
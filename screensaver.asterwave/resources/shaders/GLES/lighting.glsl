@@ -0,0 +1,95 @@
+// Put in front of vert.glsl and displacevert.glsl after the #version
+// line and the #defines of the variant by CScreensaverAsterwave::Start(),
+// so it can only use what it declares itself. The lighting takes the
+// uniforms and the vertex as arguments and hands its results back.
+
+precision mediump float;
+
+// Structs
+struct Light {
+  // all lights
+  vec4 position; // if directional light, this must be normalized (so that we dont have to normalize it here)
+  vec4 ambient;
+  vec4 diffuse;
+  vec4 specular;
+
+  // point light & spotlight
+  float constantAttenuation;
+  float linearAttenuation;
+  float quadraticAttenuation;
+
+  // spotlight
+  vec3 spotDirection;
+  float spotExponent;
+  float spotCutoffAngleCos;
+};
+
+struct Material {
+  vec4 ambient;
+  vec4 diffuse;
+  vec4 specular;
+  vec4 emission;
+  float shininess;
+};
+
+#if defined(VERTEX_LIGHTING)
+// calcPerFragmentLighting() of frag.glsl done once per vertex, only
+// for the point light that CScreensaverAsterwave::CreateLight() sets up
+vec4 calcPerVertexLighting(Light light, Material material, vec3 positionInEye, vec3 normal)
+{
+  vec3 lightVector = light.position.xyz - positionInEye;
+  vec3 halfVector = normalize(normalize(-positionInEye) + lightVector);
+
+  vec3 attenuationDistance;
+  attenuationDistance.x = 1.0;
+  attenuationDistance.z = dot(lightVector, lightVector);
+  attenuationDistance.y = sqrt(attenuationDistance.z);
+  float attenuationFactor = 1.0 / dot(attenuationDistance, vec3(light.constantAttenuation, light.linearAttenuation, light.quadraticAttenuation));
+
+  float cosL = max(0.0, dot(normal, normalize(lightVector)));
+  float cosH = dot(normal, halfVector);
+
+  vec4 color = (light.diffuse * material.diffuse) * cosL;
+  if (cosH > 0.0)
+    color += (material.specular * light.specular) * pow(cosH, material.shininess);
+
+  color *= attenuationFactor;
+  color += material.ambient + material.emission + light.ambient * material.ambient;
+  color.a = material.diffuse.a;
+
+  return clamp(color, 0.0, 1.0);
+}
+#else
+// The varyings calcPerFragmentLighting() of frag.glsl works from
+void calcLightVaryingsForFragmentShader(Light light, Material material, vec3 positionInEye, vec3 eyeVector,
+                                        inout vec4 ambientAndEmission, out vec3 lightVector, out vec3 halfVector)
+{
+  ambientAndEmission += light.ambient * material.ambient;
+#if defined(POINT_LIGHT)
+  lightVector = light.position.xyz - positionInEye;
+#else
+  if (light.position.w != 0.0)
+      lightVector = light.position.xyz - positionInEye;
+  else
+      lightVector = light.position.xyz;
+#endif
+  halfVector = normalize(eyeVector + lightVector);
+}
+
+#define LIGHT_MODEL_LOCAL_VIEWER_ENABLED 1
+void calcLightingVaryingsForFragmentShader(Light light, Material material, vec3 positionInEye,
+                                           out vec4 ambientAndEmission, out vec3 lightVector, out vec3 halfVector)
+{
+  vec3 eyeVector;
+  #if LIGHT_MODEL_LOCAL_VIEWER_ENABLED == 1
+  eyeVector = normalize(-positionInEye);
+  #elif LIGHT_MODEL_LOCAL_VIEWER_ENABLED == 0
+  eyeVector = vec3(0.0, 0.0, 1.0);
+  #endif
+
+  ambientAndEmission = material.ambient;
+  ambientAndEmission += material.emission;
+
+  calcLightVaryingsForFragmentShader(light, material, positionInEye, eyeVector, ambientAndEmission, lightVector, halfVector);
+}
+#endif
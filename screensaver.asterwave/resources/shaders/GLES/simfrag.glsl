@@ -0,0 +1,43 @@
+#version 300 es
+
+precision highp float;
+
+// One step of the water, see WaterSolverReference::Step. Every texel
+// holds height, velocity and previous height of one cell. Neighbours
+// outside the field are left out of the tension, like in
+// WaterVelocityRowClamped.
+
+// Uniforms
+uniform highp sampler2D u_state;
+uniform vec2 u_texel;
+uniform float u_restHeight;
+uniform float u_elasticity;
+uniform float u_viscosity;
+uniform float u_tension;
+uniform float u_time;
+
+// Varyings
+in vec2 v_coord;
+
+out vec4 fragColor;
+
+void main()
+{
+  vec4 cell = texture(u_state, v_coord);
+  float c = cell.x;
+
+  float cumulativeTension = 0.0;
+  for (int y = -1; y <= 1; y++)
+    for (int x = -1; x <= 1; x++)
+    {
+      vec2 coord = v_coord + vec2(x, y) * u_texel;
+      if (all(greaterThan(coord, vec2(0.0))) && all(lessThan(coord, vec2(1.0))))
+        cumulativeTension += texture(u_state, coord).x - c;
+    }
+
+  float velocity = cell.y + u_elasticity * (u_restHeight - c)
+    - u_viscosity * cell.y
+    + u_tension * cumulativeTension;
+
+  fragColor = vec4(c + velocity * u_time, velocity, c, 0.0);
+}
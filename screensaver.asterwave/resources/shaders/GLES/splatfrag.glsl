@@ -0,0 +1,16 @@
+#version 300 es
+
+precision highp float;
+
+// Blended with the weight as alpha this pulls the height towards the
+// stamped height and slows the velocity down
+
+// Varyings
+in vec2 v_splat;
+
+out vec4 fragColor;
+
+void main()
+{
+  fragColor = vec4(v_splat.y, 0.0, 0.0, v_splat.x);
+}
@@ -0,0 +1,64 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "QualityGovernor.h"
+
+#include <algorithm>
+#include <cmath>
+
+void CQualityGovernor::Init(int divs, int minDivs, int maxDivs, double budget)
+{
+  m_minDivs = minDivs;
+  m_maxDivs = maxDivs;
+  m_divs = std::min(std::max(divs, minDivs), maxDivs);
+  m_budget = budget;
+  m_percentile = 0.0;
+  m_times.assign(QUALITY_WINDOW, 0.0);
+  m_next = 0;
+  m_count = 0;
+  m_cooldown = 0;
+}
+
+int CQualityGovernor::AddFrame(double time)
+{
+  m_times[m_next] = time;
+  m_next = (m_next + 1) % QUALITY_WINDOW;
+  if (m_count < QUALITY_WINDOW)
+    m_count++;
+  if (m_cooldown > 0)
+    m_cooldown--;
+  if (m_count < QUALITY_WINDOW || m_cooldown > 0)
+    return m_divs;
+
+  m_sorted = m_times;
+  const size_t rank = (size_t)(QUALITY_PERCENTILE * (m_sorted.size() - 1));
+  std::nth_element(m_sorted.begin(), m_sorted.begin() + rank, m_sorted.end());
+  m_percentile = m_sorted[rank];
+  m_cooldown = QUALITY_COOLDOWN;
+
+  int divs = m_divs;
+  if (m_percentile > m_budget)
+  {
+    // Rounded down to a step, which leaves some room below the budget
+    const double scale = std::sqrt(m_budget / m_percentile);
+    divs = (int)(m_divs * scale) / QUALITY_STEP * QUALITY_STEP;
+    divs = std::min(divs, m_divs - QUALITY_STEP);
+  }
+  else if (m_percentile < QUALITY_RAISE_SHARE * m_budget)
+  {
+    divs = m_divs + QUALITY_STEP;
+  }
+
+  divs = std::min(std::max(divs, m_minDivs), m_maxDivs);
+  if (divs != m_divs)
+  {
+    // The frames in the window were taken at the old subdivision
+    m_divs = divs;
+    m_count = 0;
+  }
+  return m_divs;
+}
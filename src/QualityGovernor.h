@@ -0,0 +1,62 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+// Frames the percentile is taken over. They are kept in a ring, so the
+// window rolls on with every frame.
+#define QUALITY_WINDOW 90
+
+// Frames between two decisions. After a change the window has to fill
+// up with frames at the new subdivision first.
+#define QUALITY_COOLDOWN 30
+
+// Share of the frames in the window that have to make the budget
+#define QUALITY_PERCENTILE 0.9f
+
+// The subdivision is only raised while the percentile stays below this
+// share of the budget. One step up costs at most (50+10)^2/50^2 = 1.44
+// times as much, so a raise can't miss the budget right away and the
+// governor settles instead of going up and down.
+#define QUALITY_RAISE_SHARE 0.6f
+
+// Subdivisions change in multiples of this
+#define QUALITY_STEP 10
+
+// Picks the subdivision of the water from the time simulating and
+// rendering took over the last frames. The cost of the grid grows with
+// the square of the subdivision, so when the percentile misses the
+// budget the subdivision is cut by the square root of the overshoot in
+// one go, while beating it by enough only raises it by one step.
+class CQualityGovernor
+{
+public:
+  void Init(int divs, int minDivs, int maxDivs, double budget);
+
+  // Adds the work time of one frame in seconds, returns the subdivision
+  // to use from now on
+  int AddFrame(double time);
+
+  int Divs() const { return m_divs; }
+  // Percentile the last decision was made on, 0 before there was one
+  double Percentile() const { return m_percentile; }
+
+private:
+  int m_divs = 0;
+  int m_minDivs = 0;
+  int m_maxDivs = 0;
+  double m_budget = 0.0;
+  double m_percentile = 0.0;
+  std::vector<double> m_times;
+  size_t m_next = 0;
+  size_t m_count = 0;
+  int m_cooldown = 0;
+  std::vector<double> m_sorted;
+};
@@ -0,0 +1,124 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "ScaledTarget.h"
+
+#include <kodi/General.h>
+
+#include <cmath>
+
+CScaledTarget::~CScaledTarget()
+{
+  Destroy();
+}
+
+bool CScaledTarget::Create(int width, int height, float scale)
+{
+  Destroy();
+
+#if defined(SCALED_TARGET_BLIT)
+  const int targetWidth = (int)lrintf(width * scale);
+  const int targetHeight = (int)lrintf(height * scale);
+  if (targetWidth >= width || targetHeight >= height || targetWidth <= 0 || targetHeight <= 0)
+    return false;
+
+  // Neither GL nor GLES can blit with scaling into a multisampled
+  // framebuffer, the blit would fail every frame
+  GLint sampleBuffers = 0;
+  glGetIntegerv(GL_SAMPLE_BUFFERS, &sampleBuffers);
+  if (sampleBuffers > 0)
+  {
+    kodi::Log(ADDON_LOG_DEBUG, "Can't scale into a multisampled framebuffer, drawing at full size");
+    return false;
+  }
+
+  GLint framebuffer, renderbuffer;
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+  glGetIntegerv(GL_RENDERBUFFER_BINDING, &renderbuffer);
+
+  m_width = targetWidth;
+  m_height = targetHeight;
+  glGenRenderbuffers(1, &m_colorBuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, m_colorBuffer);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, m_width, m_height);
+
+  glGenFramebuffers(1, &m_framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_colorBuffer);
+  const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+
+  if (status != GL_FRAMEBUFFER_COMPLETE)
+  {
+    kodi::Log(ADDON_LOG_ERROR, "Failed to create the scaled render target (status 0x%x)", status);
+    Destroy();
+    return false;
+  }
+  return true;
+#else
+  return false;
+#endif
+}
+
+void CScaledTarget::Destroy()
+{
+  if (m_framebuffer != 0)
+    glDeleteFramebuffers(1, &m_framebuffer);
+  if (m_colorBuffer != 0)
+    glDeleteRenderbuffers(1, &m_colorBuffer);
+  m_framebuffer = m_colorBuffer = 0;
+  m_width = m_height = 0;
+}
+
+float CScaledTarget::AutoScale(int width, int height)
+{
+  const float pixels = (float)width * height;
+  if (pixels <= SCALED_TARGET_AUTO_PIXELS)
+    return 1.0f;
+  return sqrtf(SCALED_TARGET_AUTO_PIXELS / pixels);
+}
+
+void CScaledTarget::Begin()
+{
+#if defined(SCALED_TARGET_BLIT)
+  if (!Active())
+    return;
+
+  // Kodi may clip to its viewport with a scissor, which would cut into
+  // the smaller target
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &m_kodiDrawFramebuffer);
+  glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &m_kodiReadFramebuffer);
+  glGetIntegerv(GL_VIEWPORT, m_kodiViewport);
+  m_kodiScissorTest = glIsEnabled(GL_SCISSOR_TEST);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+  glViewport(0, 0, m_width, m_height);
+  glDisable(GL_SCISSOR_TEST);
+#endif
+}
+
+void CScaledTarget::End()
+{
+#if defined(SCALED_TARGET_BLIT)
+  if (!Active())
+    return;
+
+  if (m_kodiScissorTest)
+    glEnable(GL_SCISSOR_TEST);
+  glViewport(m_kodiViewport[0], m_kodiViewport[1], m_kodiViewport[2], m_kodiViewport[3]);
+
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, m_framebuffer);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, m_kodiDrawFramebuffer);
+  glBlitFramebuffer(0, 0, m_width, m_height,
+                    m_kodiViewport[0], m_kodiViewport[1],
+                    m_kodiViewport[0] + m_kodiViewport[2], m_kodiViewport[1] + m_kodiViewport[3],
+                    GL_COLOR_BUFFER_BIT, GL_LINEAR);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, m_kodiReadFramebuffer);
+#endif
+}
@@ -0,0 +1,63 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <kodi/gui/gl/GL.h>
+
+// Scaling blits between framebuffers came with GL 3 and GLES 3
+#if !defined(HAS_GLES) || HAS_GLES >= 3
+#define SCALED_TARGET_BLIT
+#endif
+
+// Output pixels drawn at full resolution by the automatic scale, larger
+// outputs are drawn at this many pixels and scaled up
+#define SCALED_TARGET_AUTO_PIXELS (1920 * 1080)
+
+// Offscreen framebuffer at a fraction of the output size. Between
+// Begin() and End() everything is drawn into it instead of the
+// framebuffer Kodi gave us, End() scales it up bilinearly into the
+// viewport Kodi had set. This trades sharpness for fill rate on large
+// outputs driven by small GPUs.
+//
+// All calls have to be made with the GL context current.
+class CScaledTarget
+{
+public:
+  CScaledTarget() = default;
+  ~CScaledTarget();
+
+  // Sets up a target of scale times width x height. Returns false when
+  // there is nothing to scale or it can't be done, drawing then goes
+  // straight to Kodi's framebuffer.
+  bool Create(int width, int height, float scale);
+  void Destroy();
+
+  // Scale that draws outputs larger than SCALED_TARGET_AUTO_PIXELS at
+  // about that many pixels, smaller ones at full size
+  static float AutoScale(int width, int height);
+
+  bool Active() const { return m_framebuffer != 0; }
+  int Width() const { return m_width; }
+  int Height() const { return m_height; }
+
+  // Redirect drawing into the target and scale it up to the output
+  void Begin();
+  void End();
+
+private:
+  GLuint m_framebuffer = 0;
+  GLuint m_colorBuffer = 0;
+  int m_width = 0;
+  int m_height = 0;
+
+  // Kodi's state while drawing into the target
+  GLint m_kodiDrawFramebuffer = 0;
+  GLint m_kodiReadFramebuffer = 0;
+  GLint m_kodiViewport[4] = {};
+  GLboolean m_kodiScissorTest = GL_FALSE;
+};
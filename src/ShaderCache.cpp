@@ -0,0 +1,219 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "ShaderCache.h"
+
+#include <kodi/Filesystem.h>
+#include <kodi/General.h>
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+// FNV-1a, stable between runs unlike std::hash
+#define SHADER_CACHE_HASH_BASIS 14695981039346656037ULL
+#define SHADER_CACHE_HASH_PRIME 1099511628211ULL
+
+// An entry starts with the length of the key and the key, then the
+// binary format and the binary itself fill the rest of the file
+struct sShaderCacheHeader
+{
+  uint32_t keyLength;
+};
+
+#if defined(SHADER_CACHE_BINARIES)
+static std::string GetGLString(GLenum name)
+{
+  const GLubyte* str = glGetString(name);
+  return str ? reinterpret_cast<const char*>(str) : "";
+}
+
+// Program binaries are core in GLES 3 and GL 4.1, older GL contexts
+// only have them with GL_ARB_get_program_binary. Without them even
+// asking for the binary formats leaves a GL error behind.
+static bool HasProgramBinaries()
+{
+  int major = 0;
+  int minor = 0;
+#if defined(HAS_GLES)
+  if (sscanf(GetGLString(GL_VERSION).c_str(), "OpenGL ES %d.%d", &major, &minor) != 2)
+    return false;
+  return major >= 3;
+#else
+  if (sscanf(GetGLString(GL_VERSION).c_str(), "%d.%d", &major, &minor) != 2)
+    return false;
+  if (major > 4 || (major == 4 && minor >= 1))
+    return true;
+
+  // The shaders need GL 3.2, which lists its extensions one by one
+  GLint extensions = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &extensions);
+  for (GLint i = 0; i < extensions; i++)
+  {
+    const GLubyte* extension = glGetStringi(GL_EXTENSIONS, i);
+    if (extension && strcmp(reinterpret_cast<const char*>(extension), "GL_ARB_get_program_binary") == 0)
+      return true;
+  }
+  return false;
+#endif
+}
+#endif
+
+bool CShaderCache::Init(const std::string& name,
+                        const std::string& vertFile,
+                        const std::string& fragFile,
+                        const std::string& vertHeader,
+                        const std::string& fragHeader)
+{
+  m_path.clear();
+  m_key.clear();
+
+#if defined(SHADER_CACHE_BINARIES)
+  if (!HasProgramBinaries())
+    return false;
+
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  if (formats <= 0)
+    return false;
+
+  std::string vertSource, fragSource;
+  if (!ReadSource(vertFile, vertSource) || !ReadSource(fragFile, fragSource))
+    return false;
+
+  uint64_t hash = SHADER_CACHE_HASH_BASIS;
+  hash = Hash(vertHeader, hash);
+  hash = Hash(vertSource, hash);
+  hash = Hash(fragHeader, hash);
+  hash = Hash(fragSource, hash);
+
+  char hashString[17];
+  snprintf(hashString, sizeof(hashString), "%016llx", static_cast<unsigned long long>(hash));
+
+  m_key = GetGLString(GL_VENDOR) + "\n" + GetGLString(GL_RENDERER) + "\n" +
+          GetGLString(GL_VERSION) + "\n" + hashString;
+  m_path = kodi::addon::GetUserPath(SHADER_CACHE_DIR + name + ".bin");
+  return true;
+#else
+  return false;
+#endif
+}
+
+GLuint CShaderCache::Load() const
+{
+#if defined(SHADER_CACHE_BINARIES)
+  if (m_path.empty() || !kodi::vfs::FileExists(m_path))
+    return 0;
+
+  kodi::vfs::CFile file;
+  if (!file.OpenFile(m_path))
+    return 0;
+
+  const int64_t length = file.GetLength();
+  if (length <= static_cast<int64_t>(sizeof(sShaderCacheHeader) + m_key.size() + sizeof(GLenum)))
+    return 0;
+
+  std::vector<char> data(length);
+  if (file.Read(data.data(), data.size()) != length)
+    return 0;
+  file.Close();
+
+  sShaderCacheHeader header;
+  memcpy(&header, data.data(), sizeof(header));
+  size_t offset = sizeof(header);
+  if (header.keyLength != m_key.size() || m_key.compare(0, m_key.size(), data.data() + offset, header.keyLength) != 0)
+  {
+    kodi::Log(ADDON_LOG_DEBUG, "Shader cache entry %s is for other shaders or another driver", m_path.c_str());
+    return 0;
+  }
+  offset += header.keyLength;
+
+  GLenum format;
+  memcpy(&format, data.data() + offset, sizeof(format));
+  offset += sizeof(format);
+
+  // A driver may still turn down its own binary, e.g. after an update
+  // that kept the version string
+  GLuint program = glCreateProgram();
+  glProgramBinary(program, format, data.data() + offset, static_cast<GLsizei>(data.size() - offset));
+  GLint linked = GL_FALSE;
+  glGetProgramiv(program, GL_LINK_STATUS, &linked);
+  if (linked != GL_TRUE)
+  {
+    kodi::Log(ADDON_LOG_DEBUG, "Shader cache entry %s was rejected by the driver", m_path.c_str());
+    glDeleteProgram(program);
+    while (glGetError() != GL_NO_ERROR)
+    {
+    }
+    return 0;
+  }
+
+  return program;
+#else
+  return 0;
+#endif
+}
+
+void CShaderCache::Store(GLuint program) const
+{
+#if defined(SHADER_CACHE_BINARIES)
+  if (m_path.empty() || program == 0)
+    return;
+
+  GLint length = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return;
+
+  std::vector<char> binary(length);
+  GLenum format = 0;
+  glGetProgramBinary(program, length, &length, &format, binary.data());
+  if (length <= 0)
+    return;
+
+  const std::string dir = kodi::addon::GetUserPath(SHADER_CACHE_DIR);
+  if (!kodi::vfs::DirectoryExists(dir) && !kodi::vfs::CreateDirectory(dir))
+    return;
+
+  kodi::vfs::CFile file;
+  if (!file.OpenFileForWrite(m_path, true))
+  {
+    kodi::Log(ADDON_LOG_DEBUG, "Failed to write shader cache entry %s", m_path.c_str());
+    return;
+  }
+
+  sShaderCacheHeader header;
+  header.keyLength = static_cast<uint32_t>(m_key.size());
+  file.Write(&header, sizeof(header));
+  file.Write(m_key.data(), m_key.size());
+  file.Write(&format, sizeof(format));
+  file.Write(binary.data(), length);
+#endif
+}
+
+bool CShaderCache::ReadSource(const std::string& file, std::string& source)
+{
+  kodi::vfs::CFile shaderFile;
+  if (!shaderFile.OpenFile(file))
+    return false;
+
+  char buffer[4096];
+  ssize_t read;
+  while ((read = shaderFile.Read(buffer, sizeof(buffer))) > 0)
+    source.append(buffer, read);
+  return true;
+}
+
+uint64_t CShaderCache::Hash(const std::string& data, uint64_t hash)
+{
+  for (unsigned char c : data)
+  {
+    hash ^= c;
+    hash *= SHADER_CACHE_HASH_PRIME;
+  }
+  return hash;
+}
@@ -0,0 +1,58 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <kodi/gui/gl/GL.h>
+
+#include <stdint.h>
+#include <string>
+
+// Program binaries came with GL 4.1 and GLES 3, GLES 2 only has them
+// as an extension
+#if !defined(HAS_GLES) || HAS_GLES >= 3
+#define SHADER_CACHE_BINARIES
+#endif
+
+// Directory in the addon profile holding the program binaries
+#define SHADER_CACHE_DIR "shadercache/"
+
+// Keeps the binary of a linked program in the addon profile, so later
+// starts can skip compiling and linking its shaders. A binary is only
+// good for the driver that made it, so the entry is keyed by the GL
+// vendor, renderer and version along with a hash of the sources, and
+// is written anew whenever any of them changes.
+//
+// All calls have to be made with the GL context current.
+class CShaderCache
+{
+public:
+  // Sets up the entry name for the program of the given shader files,
+  // with vertHeader and fragHeader put in front of them. Returns false
+  // when the driver can't hand out program binaries or the files can't
+  // be read.
+  bool Init(const std::string& name,
+            const std::string& vertFile,
+            const std::string& fragFile,
+            const std::string& vertHeader,
+            const std::string& fragHeader);
+
+  // Returns a program made from the stored binary, or 0 when there is
+  // none for this driver and these sources
+  GLuint Load() const;
+  // Stores the binary of the linked program
+  void Store(GLuint program) const;
+
+  // Appends the contents of file to source
+  static bool ReadSource(const std::string& file, std::string& source);
+
+private:
+  static uint64_t Hash(const std::string& data, uint64_t hash);
+
+  std::string m_path;
+  std::string m_key;
+};
@@ -0,0 +1,109 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "StreamBuffer.h"
+
+// Nanoseconds to wait for a fence before flushing and waiting again
+#define STREAM_BUFFER_WAIT_TIME 1000000
+
+CStreamBuffer::~CStreamBuffer()
+{
+  Destroy();
+}
+
+void CStreamBuffer::Create(size_t size)
+{
+  Destroy();
+
+  m_size = size;
+  m_region = 0;
+  glGenBuffers(1, &m_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+#if defined(STREAM_BUFFER_MAPPED)
+  glBufferData(GL_ARRAY_BUFFER, STREAM_BUFFER_REGIONS * size, nullptr, GL_STREAM_DRAW);
+#else
+  glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+  m_data.resize(size);
+#endif
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void CStreamBuffer::Destroy()
+{
+  if (m_buffer == 0)
+    return;
+
+#if defined(STREAM_BUFFER_MAPPED)
+  for (GLsync& fence : m_fences)
+  {
+    if (fence)
+      glDeleteSync(fence);
+    fence = nullptr;
+  }
+#endif
+  glDeleteBuffers(1, &m_buffer);
+  m_buffer = 0;
+  m_size = 0;
+  m_mapped = nullptr;
+  m_data.clear();
+}
+
+void* CStreamBuffer::Map()
+{
+  glBindBuffer(GL_ARRAY_BUFFER, m_buffer);
+#if defined(STREAM_BUFFER_MAPPED)
+  m_region = (m_region + 1) % STREAM_BUFFER_REGIONS;
+  Wait(m_region);
+  m_mapped = glMapBufferRange(GL_ARRAY_BUFFER, Offset(m_region), m_size,
+                              GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  if (m_mapped)
+    return m_mapped;
+  m_data.resize(m_size);
+#endif
+  return m_data.data();
+}
+
+size_t CStreamBuffer::Unmap()
+{
+#if defined(STREAM_BUFFER_MAPPED)
+  if (m_mapped)
+  {
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    m_mapped = nullptr;
+  }
+  else
+    glBufferSubData(GL_ARRAY_BUFFER, Offset(m_region), m_size, m_data.data());
+  return Offset(m_region);
+#else
+  glBufferData(GL_ARRAY_BUFFER, m_size, m_data.data(), GL_STREAM_DRAW);
+  return 0;
+#endif
+}
+
+void CStreamBuffer::Fence()
+{
+#if defined(STREAM_BUFFER_MAPPED)
+  if (m_fences[m_region])
+    glDeleteSync(m_fences[m_region]);
+  m_fences[m_region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+#endif
+}
+
+void CStreamBuffer::Wait(int region)
+{
+#if defined(STREAM_BUFFER_MAPPED)
+  GLsync& fence = m_fences[region];
+  if (!fence)
+    return;
+
+  while (glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, STREAM_BUFFER_WAIT_TIME) == GL_TIMEOUT_EXPIRED)
+  {
+  }
+  glDeleteSync(fence);
+  fence = nullptr;
+#endif
+}
@@ -0,0 +1,66 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <kodi/gui/gl/GL.h>
+
+#include <stddef.h>
+#include <vector>
+
+// Regions of a stream buffer, enough for the frames the GPU may still
+// be working on
+#define STREAM_BUFFER_REGIONS 3
+
+// Mapping buffer ranges and fences came with GL 3 and GLES 3
+#if !defined(HAS_GLES) || HAS_GLES >= 3
+#define STREAM_BUFFER_MAPPED
+#endif
+
+// Array buffer for vertices that are written anew every frame. It is
+// split into STREAM_BUFFER_REGIONS regions used round robin, each one
+// is written through an unsynchronized mapping and fenced after the
+// draws reading it, so neither the driver nor the GPU have to wait for
+// each other. Without STREAM_BUFFER_MAPPED, or when mapping fails, the
+// vertices go through a client side copy instead.
+//
+// All calls have to be made with the GL context current.
+class CStreamBuffer
+{
+public:
+  CStreamBuffer() = default;
+  ~CStreamBuffer();
+
+  // Sets up regions of size bytes each
+  void Create(size_t size);
+  void Destroy();
+
+  // Binds the buffer to GL_ARRAY_BUFFER and returns the next region to
+  // fill. The buffer has to stay bound until Unmap(), which returns the
+  // offset of the region in the buffer.
+  void* Map();
+  size_t Unmap();
+  // Marks the region as read by the draws issued since Unmap()
+  void Fence();
+
+  GLuint Buffer() const { return m_buffer; }
+  // Region last handed out by Map() and where a region starts
+  int Region() const { return m_region; }
+  size_t Offset(int region) const { return region * m_size; }
+
+private:
+  void Wait(int region);
+
+  GLuint m_buffer = 0;
+  size_t m_size = 0;
+  int m_region = 0;
+  void* m_mapped = nullptr;
+  std::vector<char> m_data;
+#if defined(STREAM_BUFFER_MAPPED)
+  GLsync m_fences[STREAM_BUFFER_REGIONS] = {};
+#endif
+};
@@ -0,0 +1,94 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#include "ThreadPool.h"
+
+CThreadPool::~CThreadPool()
+{
+  Stop();
+}
+
+void CThreadPool::Start(unsigned int threads)
+{
+  Stop();
+
+  if (threads == 0)
+    threads = std::thread::hardware_concurrency();
+  if (threads == 0)
+    threads = 1;
+
+  m_stop = false;
+  for (unsigned int i = 1; i < threads; i++)
+    m_workers.emplace_back(&CThreadPool::Worker, this, i);
+}
+
+void CThreadPool::Stop()
+{
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_stop = true;
+  }
+  m_wake.notify_all();
+  for (auto& worker : m_workers)
+    worker.join();
+  m_workers.clear();
+}
+
+void CThreadPool::Run(int count, int minPerBand, const BandTask& task)
+{
+  int bands = static_cast<int>(Threads());
+  if (minPerBand > 0 && count / minPerBand < bands)
+    bands = count / minPerBand;
+  if (bands <= 1)
+  {
+    task(0, count);
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_task = &task;
+    m_count = count;
+    m_bands = bands;
+    m_pending = bands - 1;
+    m_generation++;
+  }
+  m_wake.notify_all();
+
+  task(0, count / bands);
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_done.wait(lock, [this] { return m_pending == 0; });
+  m_task = nullptr;
+}
+
+void CThreadPool::Worker(unsigned int index)
+{
+  unsigned int generation = 0;
+  std::unique_lock<std::mutex> lock(m_mutex);
+  while (true)
+  {
+    m_wake.wait(lock, [&] { return m_stop || m_generation != generation; });
+    if (m_stop)
+      return;
+
+    generation = m_generation;
+    if (static_cast<int>(index) >= m_bands)
+      continue;
+
+    const BandTask* task = m_task;
+    const int begin = static_cast<int>(index) * m_count / m_bands;
+    const int end = static_cast<int>(index + 1) * m_count / m_bands;
+
+    lock.unlock();
+    (*task)(begin, end);
+    lock.lock();
+
+    if (--m_pending == 0)
+      m_done.notify_one();
+  }
+}
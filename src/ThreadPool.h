@@ -0,0 +1,50 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Small persistent pool used to split the water simulation into row
+// bands. The calling thread always works on the first band itself, so
+// a pool started with one thread has no workers and runs everything
+// inline.
+class CThreadPool
+{
+public:
+  typedef std::function<void(int begin, int end)> BandTask;
+
+  CThreadPool() = default;
+  ~CThreadPool();
+
+  // threads = 0 selects one thread per available core
+  void Start(unsigned int threads);
+  void Stop();
+  unsigned int Threads() const { return static_cast<unsigned int>(m_workers.size()) + 1; }
+
+  // Splits [0, count) into bands of at least minPerBand items, runs task
+  // on every band and returns once all of them are done.
+  void Run(int count, int minPerBand, const BandTask& task);
+
+private:
+  void Worker(unsigned int index);
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_wake;
+  std::condition_variable m_done;
+  const BandTask* m_task = nullptr;
+  int m_count = 0;
+  int m_bands = 0;
+  int m_pending = 0;
+  unsigned int m_generation = 0;
+  bool m_stop = false;
+};
@@ -19,6 +19,13 @@
 #include <memory.h>
 #include <chrono>
 
+// Version of the water shaders, which leave it to the loader
+#if defined(HAS_GLES)
+#define SHADER_VERSION "#version 100\n"
+#else
+#define SHADER_VERSION "#version 150\n"
+#endif
+
 AnimationEffect * effects[] = {
 
   new EffectBoil(),
@@ -46,20 +53,34 @@ CScreensaverAsterwave::CScreensaverAsterwave()
 // is activated by Kodi.
 bool CScreensaverAsterwave::Start()
 {
+  //SetupGradientBackground(CRGBA(255,0,0,255), CRGBA(0,0,0,255));
+
+  m_iWidth = Width();
+  m_iHeight = Height();
+  memset(&m_world, 0, sizeof(WaterSettings));
+  SetDefaults();
+
   std::string fraqShader = kodi::addon::GetAddonPath("resources/shaders/" GL_TYPE_STRING "/frag.glsl");
   std::string vertShader = kodi::addon::GetAddonPath("resources/shaders/" GL_TYPE_STRING "/vert.glsl");
-  if (!LoadShaderFiles(vertShader, fraqShader) || !CompileAndLink())
+  if (m_world.isVertexDisplacement)
+    vertShader = kodi::addon::GetAddonPath("resources/shaders/" GL_TYPE_STRING "/displacevert.glsl");
+  // The variant for the render mode is picked with #defines, which
+  // have to follow the #version line. CreateLight() always sets up a
+  // point light.
+  std::string header = SHADER_VERSION "#define POINT_LIGHT\n";
+  header += m_world.isTextureMode ? "#define TEXTURED\n" : "#define VERTEX_COLOR\n";
+  if (m_world.isVertexLighting)
+    header += "#define VERTEX_LIGHTING\n";
+  // Both vertex shaders share the structs and the lighting of
+  // lighting.glsl, which follows the #defines
+  std::string vertHeader = header;
+  if (!CShaderCache::ReadSource(kodi::addon::GetAddonPath("resources/shaders/" GL_TYPE_STRING "/lighting.glsl"), vertHeader) ||
+      !LoadShader(vertShader, fraqShader, vertHeader, header))
   {
     kodi::Log(ADDON_LOG_ERROR, "Failed to create and compile shader");
     return false;
   }
 
-  //SetupGradientBackground(CRGBA(255,0,0,255), CRGBA(0,0,0,255));
-
-  m_iWidth = Width();
-  m_iHeight = Height();
-  memset(&m_world, 0, sizeof(WaterSettings));
-
   float ratio = (float)m_iWidth/(float)m_iHeight;
 
   m_world.scaleX = 1.0f;
@@ -67,9 +88,25 @@ bool CScreensaverAsterwave::Start()
   if ( (ratio * m_iWidth / m_iHeight) > 1.5)
     m_world.scaleX = 1/1.333f;
 
-  SetDefaults();
   CreateLight();
   m_world.waterField = new WaterField(this, xmin, xmax, ymin, ymax, xdivs, ydivs, height, elasticity, viscosity, tension, blendability, m_world.isTextureMode);
+  m_world.waterField->SetSolver(m_solver);
+  m_world.waterField->Solver().SetPlanesRead(!m_world.isVertexDisplacement);
+  kodi::Log(ADDON_LOG_DEBUG, "Using %s water solver", m_world.waterField->Solver().Name());
+  if (m_world.isThreadedSim && m_world.waterField->Solver().UsesGL())
+  {
+    kodi::Log(ADDON_LOG_DEBUG, "The %s water solver needs the render thread, not using a simulation thread", m_world.waterField->Solver().Name());
+    m_world.isThreadedSim = false;
+  }
+#if defined(ASTERWAVE_BOXSUM_TENSION)
+  kodi::Log(ADDON_LOG_DEBUG, "Using box sum water simulation kernel");
+#else
+  kodi::Log(ADDON_LOG_DEBUG, "Using %s water simulation kernel", GetWaterKernelName());
+#endif
+
+  m_threadPool.Start(m_threads);
+  m_world.waterField->SetThreadPool(&m_threadPool);
+  kodi::Log(ADDON_LOG_DEBUG, "Simulating water on %u threads", m_threadPool.Threads());
   LoadEffects();
 
   if (m_world.isTextureMode)
@@ -84,11 +121,31 @@ bool CScreensaverAsterwave::Start()
 
   SetCamera();
 
+  const float scale = m_renderScale > 0 ? m_renderScale / 100.0f : CScaledTarget::AutoScale(m_iWidth, m_iHeight);
+  if (m_scaledTarget.Create(m_iWidth, m_iHeight, scale))
+    kodi::Log(ADDON_LOG_DEBUG, "Drawing the water at %dx%d and scaling it to %dx%d",
+              m_scaledTarget.Width(), m_scaledTarget.Height(), m_iWidth, m_iHeight);
+
   glGenBuffers(1, &m_vertexVBO);
 
   auto time = std::chrono::high_resolution_clock::now();
   m_lastTime = std::chrono::duration<double>(time.time_since_epoch()).count();
   m_lastImageTime = m_lastTime;
+  m_stepAccumulator = 0.0f;
+  m_statsTime = m_lastTime;
+  m_statsActiveTiles = 0;
+  m_statsSteps = 0;
+
+  m_governor.Init(xdivs, QUALITY_MIN_DIVS, QUALITY_MAX_DIVS, QUALITY_FRAME_BUDGET);
+  m_stepTime = 0.0;
+
+  if (m_world.isThreadedSim)
+  {
+    m_world.waterField->EnableSnapshots(true);
+    StartSimulationThread();
+    kodi::Log(ADDON_LOG_DEBUG, "Simulating water on a separate thread");
+  }
+
   m_startOK = true;
   return true;
 }
@@ -102,8 +159,19 @@ void CScreensaverAsterwave::Stop()
     return;
   m_startOK = false;
 
+  StopSimulationThread();
+  m_threadPool.Stop();
+
   glDeleteBuffers(1, &m_vertexVBO);
   m_vertexVBO = 0;
+  DeleteGrid();
+  m_scaledTarget.Destroy();
+  if (m_cachedProgram != 0)
+    glDeleteProgram(m_cachedProgram);
+  m_cachedProgram = 0;
+  if (m_lightingUBO != 0)
+    glDeleteBuffers(1, &m_lightingUBO);
+  m_lightingUBO = 0;
 
   if (m_Texture != 0)
     glDeleteTextures(1, &m_Texture);
@@ -123,33 +191,55 @@ void CScreensaverAsterwave::Render()
   if (!m_startOK)
     return;
 
-  /*
-   * Following Extra work done here in render to prevent problems with controls
-   * from Kodi and during window moving.
-   * TODO: Maybe add a separate interface call to inform about?
-   */
-  //@{
-  glBindBuffer(GL_ARRAY_BUFFER, m_vertexVBO);
-  glBindTexture(GL_TEXTURE_2D, m_Texture);
-
-  glVertexAttribPointer(m_hVertex, 4, GL_FLOAT, GL_TRUE, sizeof(sLight), BUFFER_OFFSET(offsetof(sLight, vertex)));
-  glEnableVertexAttribArray(m_hVertex);
-
-  glVertexAttribPointer(m_hNormal, 4, GL_FLOAT, GL_TRUE, sizeof(sLight), BUFFER_OFFSET(offsetof(sLight, vertex)));
-  glEnableVertexAttribArray(m_hNormal);
-
-  glVertexAttribPointer(m_hColor, 4, GL_FLOAT, GL_TRUE, sizeof(sLight), BUFFER_OFFSET(offsetof(sLight, color)));
-  glEnableVertexAttribArray(m_hColor);
-
-  glVertexAttribPointer(m_hCoord, 2, GL_FLOAT, GL_TRUE, sizeof(sLight), BUFFER_OFFSET(offsetof(sLight, coord)));
-  glEnableVertexAttribArray(m_hCoord);
-  //@}
-
   auto time = std::chrono::high_resolution_clock::now();
   double currentTime = std::chrono::duration<double>(time.time_since_epoch()).count();
   float frameTime = currentTime - m_lastTime;
   m_lastTime = currentTime;
 
+  if (m_world.isAdaptiveQuality && m_governor.Divs() != m_world.waterField->XDivs())
+    RebuildField(m_governor.Divs());
+
+  // Stepped first, the GPU solver draws into its own targets and would
+  // undo the attribute setup below
+  if (m_world.isThreadedSim)
+  {
+    // The simulation thread steps on its own, pick up its latest
+    // snapshot and blend in the last step over one step time
+    m_world.waterField->AcquireSnapshot();
+    const double age = currentTime - m_world.waterField->SnapshotTime();
+    m_world.waterField->SetRenderInterpolation(fminf((float)(age / FIXED_STEP_TIME), 1.0f));
+  }
+  else if (m_world.isFixedStep)
+  {
+    StepFixed(frameTime);
+    m_world.waterField->SetRenderInterpolation(m_stepAccumulator / FIXED_STEP_TIME);
+  }
+  else
+  {
+    StepSimulation(frameTime);
+  }
+
+  if (!m_world.isVertexDisplacement)
+  {
+    /*
+     * Following Extra work done here in render to prevent problems with controls
+     * from Kodi and during window moving.
+     * TODO: Maybe add a separate interface call to inform about?
+     */
+    //@{
+    glBindTexture(GL_TEXTURE_2D, m_Texture);
+#if defined(ASTERWAVE_VERTEX_ARRAYS)
+    // The attributes of the water live in m_gridVAOs, DrawGrid() binds
+    // the one for the frame and the array Kodi had is put back below
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &m_kodiVAO);
+#endif
+    //@}
+  }
+
+  // Everything up to the scaling below goes into the scaled target
+  // when there is one
+  m_scaledTarget.Begin();
+
   // clear
   glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
   glClear(GL_COLOR_BUFFER_BIT);
@@ -158,13 +248,119 @@ void CScreensaverAsterwave::Render()
   CreateLight();
   SetupRenderState();
 
-  m_world.frame++;
   if (m_world.isTextureMode && m_world.nextTextureTime>0 && (m_lastImageTime+m_world.nextTextureTime < currentTime))
   {
     LoadTexture();
     m_lastImageTime = currentTime;
   }
 
+  if (m_world.isVertexDisplacement)
+    RenderDisplaced();
+  else
+    m_world.waterField->Render();
+  if (!m_world.isThreadedSim)
+    LogStatistics(currentTime);
+
+#ifndef HAS_GLES
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+#endif
+
+  m_scaledTarget.End();
+
+  if (!m_world.isVertexDisplacement)
+  {
+#if defined(ASTERWAVE_VERTEX_ARRAYS)
+    glBindVertexArray(m_kodiVAO);
+#else
+    glDisableVertexAttribArray(m_hVertex);
+    glDisableVertexAttribArray(m_hHeight);
+    glDisableVertexAttribArray(m_hNormal);
+    glDisableVertexAttribArray(m_hColor);
+    glDisableVertexAttribArray(m_hCoord);
+#endif
+  }
+
+  if (m_world.isAdaptiveQuality)
+  {
+    time = std::chrono::high_resolution_clock::now();
+    double renderTime = std::chrono::duration<double>(time.time_since_epoch()).count() - currentTime;
+    // Without the simulation thread the steps were part of this frame
+    const double stepTime = m_stepTime.exchange(0.0);
+    if (m_world.isThreadedSim)
+      renderTime += stepTime;
+    m_governor.AddFrame(renderTime);
+  }
+}
+
+// Advances the simulation in fixed steps whatever the refresh rate,
+// time that can not be caught up within one frame is dropped.
+int CScreensaverAsterwave::StepFixed(float frameTime)
+{
+  m_stepAccumulator += frameTime;
+  int steps = 0;
+  while (m_stepAccumulator >= FIXED_STEP_TIME && steps < MAX_STEPS_PER_FRAME)
+  {
+    StepSimulation(FIXED_STEP_TIME);
+    m_stepAccumulator -= FIXED_STEP_TIME;
+    steps++;
+  }
+  if (m_stepAccumulator >= FIXED_STEP_TIME)
+    m_stepAccumulator = fmodf(m_stepAccumulator, FIXED_STEP_TIME);
+  return steps;
+}
+
+void CScreensaverAsterwave::StartSimulationThread()
+{
+  m_simStop = false;
+  m_simThread = std::thread(&CScreensaverAsterwave::SimulationThread, this);
+}
+
+void CScreensaverAsterwave::StopSimulationThread()
+{
+  if (!m_simThread.joinable())
+    return;
+
+  {
+    std::unique_lock<std::mutex> lock(m_simMutex);
+    m_simStop = true;
+  }
+  m_simWake.notify_all();
+  m_simThread.join();
+}
+
+/************************************************************
+SimulationThread
+
+Runs the effects and the fixed steps away from the render
+thread, publishing a snapshot of the field after each batch of
+steps and sleeping until the next step is due.
+************************************************************/
+void CScreensaverAsterwave::SimulationThread()
+{
+  auto time = std::chrono::high_resolution_clock::now();
+  double lastTime = std::chrono::duration<double>(time.time_since_epoch()).count();
+
+  std::unique_lock<std::mutex> lock(m_simMutex);
+  while (!m_simStop)
+  {
+    lock.unlock();
+    time = std::chrono::high_resolution_clock::now();
+    const double currentTime = std::chrono::duration<double>(time.time_since_epoch()).count();
+    if (StepFixed(currentTime - lastTime) > 0)
+      m_world.waterField->PublishSnapshot(currentTime);
+    LogStatistics(currentTime);
+    lastTime = currentTime;
+    lock.lock();
+
+    const auto wait = std::chrono::duration<float>(FIXED_STEP_TIME - m_stepAccumulator);
+    m_simWake.wait_for(lock, wait, [this] { return m_simStop; });
+  }
+}
+
+void CScreensaverAsterwave::StepSimulation(float time)
+{
+  const auto start = std::chrono::high_resolution_clock::now();
+  m_world.frame++;
   if (m_world.frame > m_world.nextEffectTime)
   {
     if ((rand() % 3)==0)
@@ -177,17 +373,61 @@ void CScreensaverAsterwave::Render()
       rand() % (effects[m_world.effectType]->maxDuration() - effects[m_world.effectType]->minDuration());
   }
   effects[m_world.effectType]->apply();
-  m_world.waterField->Step(frameTime);
-  m_world.waterField->Render();
+  m_world.waterField->Step(time);
 
-#ifndef HAS_GLES
-  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-#endif
+  m_statsActiveTiles += m_world.waterField->ActiveTiles();
+  m_statsSteps++;
+
+  const double stepTime = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+  double total = m_stepTime.load();
+  while (!m_stepTime.compare_exchange_weak(total, total + stepTime))
+  {
+  }
+}
 
-  glDisableVertexAttribArray(m_hVertex);
-  glDisableVertexAttribArray(m_hNormal);
-  glDisableVertexAttribArray(m_hColor);
-  glDisableVertexAttribArray(m_hCoord);
+/************************************************************
+RebuildField
+
+Replaces the water field by one at another subdivision that
+carries on with the resampled water of the old one. The
+simulation thread is held while the fields are swapped, the
+grid of the renderer follows the new field on its own.
+************************************************************/
+void CScreensaverAsterwave::RebuildField(int divs)
+{
+  StopSimulationThread();
+
+  WaterField* oldField = m_world.waterField;
+  kodi::Log(ADDON_LOG_DEBUG, "Rebuilding the water field at %ix%i, %.2f ms per frame at %ix%i",
+            divs, divs, m_governor.Percentile() * 1000.0, oldField->XDivs(), oldField->YDivs());
+  xdivs = divs;
+  ydivs = divs;
+  WaterField* field = new WaterField(this, xmin, xmax, ymin, ymax, xdivs, ydivs, height, elasticity, viscosity, tension, blendability, m_world.isTextureMode);
+  field->Resample(*oldField);
+  field->SetSolver(m_solver);
+  field->Solver().SetPlanesRead(!m_world.isVertexDisplacement);
+  field->SetThreadPool(&m_threadPool);
+  m_world.waterField = field;
+  delete oldField;
+
+  if (m_world.isThreadedSim)
+  {
+    field->EnableSnapshots(true);
+    StartSimulationThread();
+  }
+}
+
+void CScreensaverAsterwave::LogStatistics(double currentTime)
+{
+  if (currentTime - m_statsTime < STATS_INTERVAL)
+    return;
+
+  if (m_statsSteps > 0)
+    kodi::Log(ADDON_LOG_DEBUG, "Water field: %.1f of %i tiles active per step over %i steps",
+              (double)m_statsActiveTiles / m_statsSteps, m_world.waterField->TileCount(), m_statsSteps);
+  m_statsActiveTiles = 0;
+  m_statsSteps = 0;
+  m_statsTime = currentTime;
 }
 
 void CScreensaverAsterwave::SetDefaults()
@@ -196,11 +436,23 @@ void CScreensaverAsterwave::SetDefaults()
   m_world.nextEffectTime = 0;
   m_world.isWireframe = false;
   m_world.isTextureMode = true;
+  m_world.isFixedStep = true;
+  m_world.isThreadedSim = false;
+  m_world.isVertexDisplacement = false;
+  m_world.isVertexLighting = false;
+  m_world.isAdaptiveQuality = true;
   m_lightDir = CVector(0.0f,0.6f,-0.8f);
 
   std::string szTextureSearchPath;
   kodi::addon::CheckSettingBoolean("wireframe", m_world.isWireframe);
   kodi::addon::CheckSettingBoolean("texturemode", m_world.isTextureMode);
+  kodi::addon::CheckSettingBoolean("fixedstep", m_world.isFixedStep);
+  kodi::addon::CheckSettingBoolean("simthread", m_world.isThreadedSim);
+#if defined(ASTERWAVE_VERTEX_DISPLACEMENT)
+  kodi::addon::CheckSettingBoolean("vertexdisplace", m_world.isVertexDisplacement);
+#endif
+  kodi::addon::CheckSettingBoolean("vertexlighting", m_world.isVertexLighting);
+  kodi::addon::CheckSettingBoolean("adaptivequality", m_world.isAdaptiveQuality);
   if (!kodi::addon::CheckSettingString("texturefolder", szTextureSearchPath) ||
       szTextureSearchPath.empty() ||
       !kodi::vfs::DirectoryExists(szTextureSearchPath))
@@ -219,13 +471,35 @@ void CScreensaverAsterwave::SetDefaults()
   ymin = kodi::addon::GetSettingInt("ymin");
   xmax = kodi::addon::GetSettingInt("xmax");
   divs = kodi::addon::GetSettingInt("quality");
+  // The quality setting only gives the subdivision the governor starts
+  // from, the fixed subdivision stays the one taken above
+  if (m_world.isAdaptiveQuality)
+  {
+    xdivs = divs;
+    ydivs = divs;
+  }
+  m_threads = kodi::addon::GetSettingInt("threads");
+  m_solver = kodi::addon::GetSettingInt("solver");
+  m_renderScale = kodi::addon::GetSettingInt("renderscale");
 }
 
 void CScreensaverAsterwave::SetCamera()
 {
   float aspectRatio = (float)m_iWidth/(float)m_iHeight;
-  m_projMat = glm::perspective(glm::radians(45.0f), aspectRatio, 1.0f, 1000.0f);
-  m_modelMat = glm::lookAt(glm::vec3(0.0f, 0.0f, -15.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, -0.707f, -0.707f));
+  const glm::mat4 projMat = glm::perspective(glm::radians(45.0f), aspectRatio, 1.0f, 1000.0f);
+  const glm::mat4 modelMat = glm::lookAt(glm::vec3(0.0f, 0.0f, -15.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, -0.707f, -0.707f));
+
+  if (projMat != m_projMat)
+  {
+    m_projMat = projMat;
+    m_matricesDirty = true;
+  }
+  if (modelMat != m_modelMat)
+  {
+    m_modelMat = modelMat;
+    m_normalMat = glm::transpose(glm::inverse(glm::mat3(m_modelMat)));
+    m_matricesDirty = true;
+  }
 }
 
 void CScreensaverAsterwave::SetMaterial()
@@ -252,6 +526,52 @@ void CScreensaverAsterwave::CreateLight()
   m_lightQuatraticAttenuation = 0.0f;
 }
 
+void CScreensaverAsterwave::GetLighting(sLightingBlock& lighting) const
+{
+  lighting = sLightingBlock{};
+  lighting.lightPosition = m_lightPosition;
+  lighting.lightAmbient = m_lightAmbient;
+  lighting.lightDiffuse = m_lightDiffuse;
+  lighting.lightSpecular = m_lightSpecular;
+  lighting.lightConstantAttenuation = m_lightConstantAttenuation;
+  lighting.lightLinearAttenuation = m_lightLinearAttenuation;
+  lighting.lightQuadraticAttenuation = m_lightQuatraticAttenuation;
+  lighting.lightSpotDirection = glm::vec3(m_lightSpotDirection);
+  lighting.lightSpotExponent = 0.0f;
+  lighting.lightSpotCutoffAngleCos = -1.0f;
+  lighting.materialAmbient = m_materialAmbient;
+  lighting.materialDiffuse = m_materialDiffuse;
+  lighting.materialSpecular = m_materialSpecular;
+  lighting.materialEmission = m_materialEmission;
+  lighting.materialShininess = m_shininess;
+}
+
+void CScreensaverAsterwave::UploadLighting(const sLightingBlock& lighting)
+{
+#if defined(ASTERWAVE_UNIFORM_BLOCK)
+  glBindBuffer(GL_UNIFORM_BUFFER, m_lightingUBO);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(lighting), &lighting);
+  glBindBuffer(GL_UNIFORM_BUFFER, 0);
+#else
+  glUniform4fv(m_light0_ambientLoc, 1, glm::value_ptr(lighting.lightAmbient));
+  glUniform4fv(m_light0_diffuseLoc, 1, glm::value_ptr(lighting.lightDiffuse));
+  glUniform4fv(m_light0_specularLoc, 1, glm::value_ptr(lighting.lightSpecular));
+  glUniform4fv(m_light0_positionLoc, 1, glm::value_ptr(lighting.lightPosition));
+  glUniform3fv(m_light0_spotDirectionLoc, 1, glm::value_ptr(lighting.lightSpotDirection));
+  glUniform1f(m_light0_constantAttenuationLoc, lighting.lightConstantAttenuation);
+  glUniform1f(m_light0_linearAttenuationLoc, lighting.lightLinearAttenuation);
+  glUniform1f(m_light0_quadraticAttenuationLoc, lighting.lightQuadraticAttenuation);
+  glUniform1f(m_light0_spotExponentLoc, lighting.lightSpotExponent);
+  glUniform1f(m_light0_spotCutoffAngleCosLoc, lighting.lightSpotCutoffAngleCos);
+
+  glUniform4fv(m_material_ambientLoc, 1, glm::value_ptr(lighting.materialAmbient));
+  glUniform4fv(m_material_diffuseLoc, 1, glm::value_ptr(lighting.materialDiffuse));
+  glUniform4fv(m_material_specularLoc, 1, glm::value_ptr(lighting.materialSpecular));
+  glUniform4fv(m_material_emissionLoc, 1, glm::value_ptr(lighting.materialEmission));
+  glUniform1f(m_material_shininessLoc, lighting.materialShininess);
+#endif
+}
+
 void CScreensaverAsterwave::LoadTexture()
 {
   // Setup our texture
@@ -269,10 +589,17 @@ void CScreensaverAsterwave::LoadTexture()
     numTextures++;
   }
 
-  if (m_Texture != 0 && !foundTexture.empty())
-    glDeleteTextures(1, &m_Texture);
+  // The current image stays when the new one can't be loaded
+  const GLuint texture = SOIL_load_OGL_texture(foundTexture.c_str(), SOIL_LOAD_RGB, 0, 0);
+  if (texture == 0)
+  {
+    kodi::Log(ADDON_LOG_DEBUG, "No texture could be loaded from %s", m_world.szTextureSearchPath.c_str());
+    return;
+  }
 
-  m_Texture = SOIL_load_OGL_texture(foundTexture.c_str(), SOIL_LOAD_RGB, 0, 0);
+  if (m_Texture != 0)
+    glDeleteTextures(1, &m_Texture);
+  m_Texture = texture;
 }
 
 void CScreensaverAsterwave::LoadEffects()
@@ -337,79 +664,488 @@ void CScreensaverAsterwave::RenderGradientBackground()
   Draw(GL_TRIANGLE_STRIP, light, 4, false);
 }
 
+// Draws vertices that carry all of their attributes, this points the
+// attributes at m_vertexVBO laid out as sLight and so has to be done
+// before the water streams are set up in Render()
 void CScreensaverAsterwave::Draw(int primitive, const sLight* data, unsigned int size, bool withTexture)
 {
   GLuint oldTexture = m_Texture;
   if (!withTexture)
     m_Texture = 0;
 
-  m_normalMat = glm::transpose(glm::inverse(glm::mat3(m_modelMat)));
+  m_coordNormalScale = 0.0f;
 
-  EnableShader();
+  glBindBuffer(GL_ARRAY_BUFFER, m_vertexVBO);
   glBufferData(GL_ARRAY_BUFFER, sizeof(sLight)*size, data, GL_DYNAMIC_DRAW);
+  glVertexAttribPointer(m_hVertex, 4, GL_FLOAT, GL_TRUE, sizeof(sLight), BUFFER_OFFSET(offsetof(sLight, vertex)));
+  glVertexAttribPointer(m_hNormal, 3, GL_FLOAT, GL_TRUE, sizeof(sLight), BUFFER_OFFSET(offsetof(sLight, normal)));
+  glVertexAttribPointer(m_hColor, 4, GL_FLOAT, GL_TRUE, sizeof(sLight), BUFFER_OFFSET(offsetof(sLight, color)));
+  glVertexAttribPointer(m_hCoord, 2, GL_FLOAT, GL_TRUE, sizeof(sLight), BUFFER_OFFSET(offsetof(sLight, coord)));
+  if (m_hHeight >= 0)
+  {
+    glDisableVertexAttribArray(m_hHeight);
+    glVertexAttrib1f(m_hHeight, 0.0f);
+  }
+
+  EnableProgram();
   glDrawArrays(primitive, 0, size);
-  DisableShader();
+  DisableProgram();
 
   if (!withTexture)
     m_Texture = oldTexture;
 }
 
+/************************************************************
+SetGridPoints / BeginGrid / DrawGrid
+
+The water is drawn as one indexed triangle list over its grid
+points. SetGridPoints takes the xdivs*ydivs points, row after
+row, and keeps them in a static buffer. Every frame BeginGrid
+maps the next region of a stream buffer for the changing part
+of their vertices, DrawGrid unmaps it and draws the whole mesh
+with a single call.
+************************************************************/
+void CScreensaverAsterwave::SetGridPoints(const sGridPoint* points, int xdivs, int ydivs)
+{
+  if (m_gridXdivs != xdivs || m_gridYdivs != ydivs)
+    CreateGrid(xdivs, ydivs);
+  if (m_gridPointVBO == 0)
+    return;
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_gridPointVBO);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(sGridPoint)*xdivs*ydivs, points, GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+sWaterVertex* CScreensaverAsterwave::BeginGrid()
+{
+  return static_cast<sWaterVertex*>(m_gridStream.Map());
+}
+
+void CScreensaverAsterwave::DrawGrid(bool withTexture)
+{
+  GLuint oldTexture = m_Texture;
+  if (!withTexture)
+    m_Texture = 0;
+
+  m_coordNormalScale = WATER_REFRACTION;
+
+#if defined(ASTERWAVE_VERTEX_ARRAYS)
+  m_gridStream.Unmap();
+  glBindVertexArray(m_gridVAOs[m_gridStream.Region()]);
+#else
+  SetGridAttributes(m_gridStream.Unmap());
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gridIBO);
+#endif
+
+  EnableProgram();
+  glDrawElements(GL_TRIANGLES, m_gridIndexCount, m_gridIndexType, BUFFER_OFFSET(0));
+  DisableProgram();
+#if !defined(ASTERWAVE_VERTEX_ARRAYS)
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+#endif
+  m_gridStream.Fence();
+
+  m_Texture = oldTexture;
+}
+
+// Points the attributes at the grid points and at the vertices
+// streamed at offset in m_gridStream
+void CScreensaverAsterwave::SetGridAttributes(size_t offset)
+{
+  glBindBuffer(GL_ARRAY_BUFFER, m_gridPointVBO);
+  glVertexAttribPointer(m_hVertex, 2, GL_FLOAT, GL_FALSE, sizeof(sGridPoint), BUFFER_OFFSET(offsetof(sGridPoint, x)));
+  glEnableVertexAttribArray(m_hVertex);
+  glVertexAttribPointer(m_hCoord, 2, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(sGridPoint), BUFFER_OFFSET(offsetof(sGridPoint, u)));
+  glEnableVertexAttribArray(m_hCoord);
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_gridStream.Buffer());
+  glVertexAttribPointer(m_hHeight, 1, GL_FLOAT, GL_FALSE, sizeof(sWaterVertex), BUFFER_OFFSET(offset + offsetof(sWaterVertex, height)));
+  glEnableVertexAttribArray(m_hHeight);
+  glVertexAttribPointer(m_hNormal, 4, ASTERWAVE_NORMAL_TYPE, GL_TRUE, sizeof(sWaterVertex), BUFFER_OFFSET(offset + offsetof(sWaterVertex, normal)));
+  glEnableVertexAttribArray(m_hNormal);
+  glVertexAttribPointer(m_hColor, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof(sWaterVertex), BUFFER_OFFSET(offset + offsetof(sWaterVertex, color)));
+  glEnableVertexAttribArray(m_hColor);
+}
+
+#if defined(ASTERWAVE_VERTEX_DISPLACEMENT)
+/************************************************************
+RenderDisplaced
+
+Draws the water as one static grid, the vertex shader looks up
+the heights of every grid point and its neighbours in a texture
+and works out position, normal and texture coordinate from them.
+Per frame only the heights, and the colors when there is no
+texture, are uploaded. With the GPU solver the heights are
+sampled straight from its state texture.
+************************************************************/
+void CScreensaverAsterwave::RenderDisplaced()
+{
+  WaterField* field = m_world.waterField;
+  if (m_gridXdivs != field->XDivs() || m_gridYdivs != field->YDivs())
+    CreateGrid(field->XDivs(), field->YDivs());
+
+  // The GPU solver's state texture holds the heights before and after
+  // the last step already, the shader blends between them itself
+  glActiveTexture(GL_TEXTURE1);
+  const GLuint stateTexture = field->Solver().HeightTexture();
+  if (stateTexture != 0)
+  {
+    glBindTexture(GL_TEXTURE_2D, stateTexture);
+    m_heightBlend = field->RenderInterpolation();
+  }
+  else
+  {
+    field->CopyRenderHeights(m_gridHeights.data());
+    glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, m_gridYdivs, m_gridXdivs, GL_RED, GL_FLOAT, m_gridHeights.data());
+    m_heightBlend = 1.0f;
+  }
+  glActiveTexture(GL_TEXTURE0);
+
+  glBindBuffer(GL_ARRAY_BUFFER, m_gridVBO);
+  glVertexAttribPointer(m_hCell, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+  glEnableVertexAttribArray(m_hCell);
+
+  GLuint oldTexture = m_Texture;
+  if (!m_world.isTextureMode)
+  {
+    m_Texture = 0;
+    field->CopyRenderColors(m_gridColors.data());
+    glBindBuffer(GL_ARRAY_BUFFER, m_gridColorVBO);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(CRGBA)*m_gridColors.size(), m_gridColors.data(), GL_STREAM_DRAW);
+    glVertexAttribPointer(m_hColor, 4, GL_FLOAT, GL_FALSE, sizeof(CRGBA), BUFFER_OFFSET(0));
+    glEnableVertexAttribArray(m_hColor);
+  }
+  else
+  {
+    // White like the vertices of the mesh in texture mode, shown when
+    // no image could be loaded
+    glVertexAttrib4f(m_hColor, 1.0f, 1.0f, 1.0f, 1.0f);
+  }
+
+  // Drawn with the vertex array Kodi has bound, its element binding is
+  // put back afterwards
+  GLint elementBuffer;
+  glGetIntegerv(GL_ELEMENT_ARRAY_BUFFER_BINDING, &elementBuffer);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gridIBO);
+  EnableProgram();
+  glDrawElements(GL_TRIANGLES, m_gridIndexCount, m_gridIndexType, BUFFER_OFFSET(0));
+  DisableProgram();
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementBuffer);
+
+  m_Texture = oldTexture;
+  glDisableVertexAttribArray(m_hCell);
+  if (!m_world.isTextureMode)
+    glDisableVertexAttribArray(m_hColor);
+}
+#else
+void CScreensaverAsterwave::RenderDisplaced()
+{
+}
+#endif
+
+// Fills the triangle list of the grid into indices, two triangles
+// per cell wound like the strips the water used to be drawn with
+template<typename T>
+static void FillGridIndices(std::vector<T>& indices, int xdivs, int ydivs)
+{
+  indices.reserve(6*(xdivs-1)*(ydivs-1));
+  for (int i = 0; i < xdivs-1; i++)
+    for (int j = 0; j < ydivs-1; j++)
+    {
+      const T v = i*ydivs + j;
+      const T below = v + ydivs;
+      indices.insert(indices.end(), { v, below, T(v+1), below, T(below+1), T(v+1) });
+    }
+}
+
+void CScreensaverAsterwave::CreateGrid(int xdivs, int ydivs)
+{
+  DeleteGrid();
+
+  m_gridXdivs = xdivs;
+  m_gridYdivs = ydivs;
+  m_gridDirty = true;
+  const size_t vertexCount = (size_t)m_gridXdivs*m_gridYdivs;
+  if (!m_world.isVertexDisplacement)
+  {
+    m_gridStream.Create(sizeof(sWaterVertex)*vertexCount);
+    glGenBuffers(1, &m_gridPointVBO);
+  }
+
+  // 16 bit indices whenever the grid allows, GLES 2 has no others.
+  // The element binding belongs to the vertex array Kodi has bound, it
+  // is put back after the upload.
+  GLint elementBuffer;
+  glGetIntegerv(GL_ELEMENT_ARRAY_BUFFER_BINDING, &elementBuffer);
+  glGenBuffers(1, &m_gridIBO);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gridIBO);
+  if (vertexCount <= 0x10000)
+  {
+    std::vector<GLushort> indices;
+    FillGridIndices(indices, m_gridXdivs, m_gridYdivs);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort)*indices.size(), indices.data(), GL_STATIC_DRAW);
+    m_gridIndexCount = indices.size();
+    m_gridIndexType = GL_UNSIGNED_SHORT;
+  }
+  else
+  {
+    std::vector<GLuint> indices;
+    FillGridIndices(indices, m_gridXdivs, m_gridYdivs);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*indices.size(), indices.data(), GL_STATIC_DRAW);
+    m_gridIndexCount = indices.size();
+    m_gridIndexType = GL_UNSIGNED_INT;
+  }
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementBuffer);
+
+#if defined(ASTERWAVE_VERTEX_ARRAYS)
+  // The layout of the mesh is set up once here, in one vertex array
+  // per region of the stream
+  if (!m_world.isVertexDisplacement)
+  {
+    GLint vertexArray;
+    glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &vertexArray);
+    glGenVertexArrays(STREAM_BUFFER_REGIONS, m_gridVAOs);
+    for (int region = 0; region < STREAM_BUFFER_REGIONS; region++)
+    {
+      glBindVertexArray(m_gridVAOs[region]);
+      SetGridAttributes(m_gridStream.Offset(region));
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gridIBO);
+    }
+    glBindVertexArray(vertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+#endif
+
+#if defined(ASTERWAVE_VERTEX_DISPLACEMENT)
+  if (!m_world.isVertexDisplacement)
+    return;
+
+  m_gridHeights.resize(m_gridXdivs*m_gridYdivs);
+  if (!m_world.isTextureMode)
+    m_gridColors.resize(m_gridXdivs*m_gridYdivs);
+
+  std::vector<float> cells;
+  cells.reserve(2*m_gridXdivs*m_gridYdivs);
+  for (int i = 0; i < m_gridXdivs; i++)
+    for (int j = 0; j < m_gridYdivs; j++)
+    {
+      cells.push_back((float)i);
+      cells.push_back((float)j);
+    }
+
+  GLint arrayBuffer;
+  glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &arrayBuffer);
+  glGenBuffers(1, &m_gridVBO);
+  glBindBuffer(GL_ARRAY_BUFFER, m_gridVBO);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(float)*cells.size(), cells.data(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, arrayBuffer);
+  glGenBuffers(1, &m_gridColorVBO);
+
+  glActiveTexture(GL_TEXTURE1);
+  glGenTextures(1, &m_heightTexture);
+  glBindTexture(GL_TEXTURE_2D, m_heightTexture);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R32F, m_gridYdivs, m_gridXdivs, 0, GL_RED, GL_FLOAT, nullptr);
+  glActiveTexture(GL_TEXTURE0);
+#endif
+}
+
+void CScreensaverAsterwave::DeleteGrid()
+{
+  if (m_gridIBO != 0)
+    glDeleteBuffers(1, &m_gridIBO);
+  if (m_gridPointVBO != 0)
+    glDeleteBuffers(1, &m_gridPointVBO);
+  m_gridStream.Destroy();
+#if defined(ASTERWAVE_VERTEX_ARRAYS)
+  if (m_gridVAOs[0] != 0)
+    glDeleteVertexArrays(STREAM_BUFFER_REGIONS, m_gridVAOs);
+  for (GLuint& vertexArray : m_gridVAOs)
+    vertexArray = 0;
+#endif
+  if (m_gridVBO != 0)
+  {
+    glDeleteBuffers(1, &m_gridVBO);
+    glDeleteBuffers(1, &m_gridColorVBO);
+    glDeleteTextures(1, &m_heightTexture);
+  }
+  m_gridVBO = m_gridColorVBO = m_gridIBO = m_gridPointVBO = m_heightTexture = 0;
+  m_gridXdivs = m_gridYdivs = 0;
+}
+
+// Takes the program from the shader cache when it has one for these
+// sources and this driver, else compiles and links the shaders and
+// stores the result for the next start
+bool CScreensaverAsterwave::LoadShader(const std::string& vertShader, const std::string& fragShader,
+                                       const std::string& vertHeader, const std::string& fragHeader)
+{
+  std::string name = m_world.isVertexDisplacement ? "displace" : "water";
+  name += m_world.isTextureMode ? "_textured" : "_colored";
+  if (m_world.isVertexLighting)
+    name += "_vertexlit";
+
+  CShaderCache cache;
+  const bool useCache = cache.Init(name, vertShader, fragShader, vertHeader, fragHeader);
+  if (useCache)
+  {
+    m_cachedProgram = cache.Load();
+    if (m_cachedProgram != 0)
+    {
+      kodi::Log(ADDON_LOG_DEBUG, "Using cached %s shader", name.c_str());
+      OnCompiledAndLinked();
+      return true;
+    }
+  }
+
+  if (!LoadShaderFiles(vertShader, fragShader) || !CompileAndLink(vertHeader, "", fragHeader, ""))
+    return false;
+
+  if (useCache)
+    cache.Store(ProgramHandle());
+  return true;
+}
+
+void CScreensaverAsterwave::EnableProgram()
+{
+  if (m_cachedProgram == 0)
+  {
+    EnableShader();
+    return;
+  }
+
+  glUseProgram(m_cachedProgram);
+  OnEnabled();
+}
+
+void CScreensaverAsterwave::DisableProgram()
+{
+  if (m_cachedProgram == 0)
+  {
+    DisableShader();
+    return;
+  }
+
+  glUseProgram(0);
+  OnDisabled();
+}
+
 void CScreensaverAsterwave::OnCompiledAndLinked()
 {
+  const GLuint program = Program();
+
   // Variables passed directly to the Vertex shader
-  m_projMatLoc = glGetUniformLocation(ProgramHandle(), "u_projectionMatrix");
-  m_modelViewMatLoc = glGetUniformLocation(ProgramHandle(), "u_modelViewMatrix");
-  m_transposeAdjointModelViewMatrixLoc = glGetUniformLocation(ProgramHandle(), "u_transposeAdjointModelViewMatrix");
-  m_textureIdLoc = glGetUniformLocation(ProgramHandle(), "u_textureId");
-
-  m_light0_ambientLoc = glGetUniformLocation(ProgramHandle(), "u_light0.ambient");
-  m_light0_diffuseLoc = glGetUniformLocation(ProgramHandle(), "u_light0.diffuse");
-  m_light0_specularLoc = glGetUniformLocation(ProgramHandle(), "u_light0.specular");
-  m_light0_positionLoc = glGetUniformLocation(ProgramHandle(), "u_light0.position");
-  m_light0_constantAttenuationLoc = glGetUniformLocation(ProgramHandle(), "u_light0.constantAttenuation");
-  m_light0_linearAttenuationLoc = glGetUniformLocation(ProgramHandle(), "u_light0.linearAttenuation");
-  m_light0_quadraticAttenuationLoc = glGetUniformLocation(ProgramHandle(), "u_light0.quadraticAttenuation");
-  m_light0_spotDirectionLoc = glGetUniformLocation(ProgramHandle(), "u_light0.spotDirection");
-  m_light0_spotExponentLoc = glGetUniformLocation(ProgramHandle(), "u_light0.spotExponent");
-  m_light0_spotCutoffAngleCosLoc = glGetUniformLocation(ProgramHandle(), "u_light0.spotCutoffAngleCos");
-
-  m_material_ambientLoc = glGetUniformLocation(ProgramHandle(), "u_material.ambient");
-  m_material_diffuseLoc = glGetUniformLocation(ProgramHandle(), "u_material.diffuse");
-  m_material_specularLoc = glGetUniformLocation(ProgramHandle(), "u_material.specular");
-  m_material_emissionLoc = glGetUniformLocation(ProgramHandle(), "u_material.emission");
-  m_material_shininessLoc = glGetUniformLocation(ProgramHandle(), "u_material.shininess");
-
-  m_hVertex = glGetAttribLocation(ProgramHandle(), "a_position");
-  m_hNormal = glGetAttribLocation(ProgramHandle(), "a_normal");
-  m_hColor = glGetAttribLocation(ProgramHandle(), "a_color");
-  m_hCoord = glGetAttribLocation(ProgramHandle(), "a_coord");
+  m_projMatLoc = glGetUniformLocation(program, "u_projectionMatrix");
+  m_modelViewMatLoc = glGetUniformLocation(program, "u_modelViewMatrix");
+  m_transposeAdjointModelViewMatrixLoc = glGetUniformLocation(program, "u_transposeAdjointModelViewMatrix");
+  m_textureIdLoc = glGetUniformLocation(program, "u_textureId");
+
+  m_light0_ambientLoc = glGetUniformLocation(program, "u_light0.ambient");
+  m_light0_diffuseLoc = glGetUniformLocation(program, "u_light0.diffuse");
+  m_light0_specularLoc = glGetUniformLocation(program, "u_light0.specular");
+  m_light0_positionLoc = glGetUniformLocation(program, "u_light0.position");
+  m_light0_constantAttenuationLoc = glGetUniformLocation(program, "u_light0.constantAttenuation");
+  m_light0_linearAttenuationLoc = glGetUniformLocation(program, "u_light0.linearAttenuation");
+  m_light0_quadraticAttenuationLoc = glGetUniformLocation(program, "u_light0.quadraticAttenuation");
+  m_light0_spotDirectionLoc = glGetUniformLocation(program, "u_light0.spotDirection");
+  m_light0_spotExponentLoc = glGetUniformLocation(program, "u_light0.spotExponent");
+  m_light0_spotCutoffAngleCosLoc = glGetUniformLocation(program, "u_light0.spotCutoffAngleCos");
+
+  m_material_ambientLoc = glGetUniformLocation(program, "u_material.ambient");
+  m_material_diffuseLoc = glGetUniformLocation(program, "u_material.diffuse");
+  m_material_specularLoc = glGetUniformLocation(program, "u_material.specular");
+  m_material_emissionLoc = glGetUniformLocation(program, "u_material.emission");
+  m_material_shininessLoc = glGetUniformLocation(program, "u_material.shininess");
+
+#if defined(ASTERWAVE_UNIFORM_BLOCK)
+  const GLuint lightingIndex = glGetUniformBlockIndex(program, "Lighting");
+  if (lightingIndex != GL_INVALID_INDEX)
+    glUniformBlockBinding(program, lightingIndex, ASTERWAVE_LIGHTING_BINDING);
+  if (m_lightingUBO == 0)
+  {
+    glGenBuffers(1, &m_lightingUBO);
+    glBindBuffer(GL_UNIFORM_BUFFER, m_lightingUBO);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(sLightingBlock), nullptr, GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+  }
+#endif
+  m_uniformsValid = false;
+  m_matricesDirty = true;
+
+  m_hVertex = glGetAttribLocation(program, "a_position");
+  m_hNormal = glGetAttribLocation(program, "a_normal");
+  m_hColor = glGetAttribLocation(program, "a_color");
+  m_hCoord = glGetAttribLocation(program, "a_coord");
+
+  // Only found in vert.glsl
+  m_hHeight = glGetAttribLocation(program, "a_height");
+  m_coordNormalScaleLoc = glGetUniformLocation(program, "u_coordNormalScale");
+
+  // Only found in displacevert.glsl
+  m_hCell = glGetAttribLocation(program, "a_cell");
+  m_heightMapLoc = glGetUniformLocation(program, "u_heightMap");
+  m_gridLoc = glGetUniformLocation(program, "u_grid");
+  m_gridSizeLoc = glGetUniformLocation(program, "u_gridSize");
+  m_normalSpreadLoc = glGetUniformLocation(program, "u_normalSpread");
+  m_heightBlendLoc = glGetUniformLocation(program, "u_heightBlend");
 }
 
 bool CScreensaverAsterwave::OnEnabled()
 {
-  // This is called after glUseProgram()
-  glUniformMatrix4fv(m_projMatLoc, 1, GL_FALSE, glm::value_ptr(m_projMat));
-  glUniformMatrix4fv(m_modelViewMatLoc, 1, GL_FALSE, glm::value_ptr(m_modelMat));
-  glUniformMatrix3fv(m_transposeAdjointModelViewMatrixLoc, 1, GL_FALSE, glm::value_ptr(m_normalMat));
-  glUniform1i(m_textureIdLoc, m_Texture);
-
-  glUniform4fv(m_light0_ambientLoc, 1, glm::value_ptr(m_lightAmbient));
-  glUniform4fv(m_light0_diffuseLoc, 1, glm::value_ptr(m_lightDiffuse));
-  glUniform4fv(m_light0_specularLoc, 1, glm::value_ptr( m_lightSpecular));
-  glUniform4fv(m_light0_positionLoc, 1, glm::value_ptr(m_lightPosition));
-  glUniform3fv(m_light0_spotDirectionLoc, 1, glm::value_ptr(m_lightSpotDirection));
-  glUniform1f(m_light0_constantAttenuationLoc, m_lightConstantAttenuation);
-  glUniform1f(m_light0_linearAttenuationLoc, m_lightLinearAttenuation);
-  glUniform1f(m_light0_quadraticAttenuationLoc, m_lightQuatraticAttenuation);
-  glUniform1f(m_light0_spotExponentLoc, 0.0f);
-  glUniform1f(m_light0_spotCutoffAngleCosLoc, -1.0f);
-
-  glUniform4fv(m_material_ambientLoc, 1, glm::value_ptr(m_materialAmbient));
-  glUniform4fv(m_material_diffuseLoc, 1, glm::value_ptr(m_materialDiffuse));
-  glUniform4fv(m_material_specularLoc, 1, glm::value_ptr(m_materialSpecular));
-  glUniform4fv(m_material_emissionLoc, 1, glm::value_ptr( m_materialEmission));
-  glUniform1f(m_material_shininessLoc, m_shininess);
+  // This is called after glUseProgram(), the program keeps the values
+  // it was given, so only what changed since is sent
+  if (m_matricesDirty || !m_uniformsValid)
+  {
+    glUniformMatrix4fv(m_projMatLoc, 1, GL_FALSE, glm::value_ptr(m_projMat));
+    glUniformMatrix4fv(m_modelViewMatLoc, 1, GL_FALSE, glm::value_ptr(m_modelMat));
+    glUniformMatrix3fv(m_transposeAdjointModelViewMatrixLoc, 1, GL_FALSE, glm::value_ptr(m_normalMat));
+    m_matricesDirty = false;
+  }
+  if (m_Texture != m_uploadedTextureId || !m_uniformsValid)
+  {
+    glUniform1i(m_textureIdLoc, m_Texture);
+    m_uploadedTextureId = m_Texture;
+  }
+  if (m_coordNormalScale != m_uploadedCoordNormalScale || !m_uniformsValid)
+  {
+    glUniform1f(m_coordNormalScaleLoc, m_coordNormalScale);
+    m_uploadedCoordNormalScale = m_coordNormalScale;
+  }
+  if (m_heightBlend != m_uploadedHeightBlend || !m_uniformsValid)
+  {
+    glUniform1f(m_heightBlendLoc, m_heightBlend);
+    m_uploadedHeightBlend = m_heightBlend;
+  }
+
+  sLightingBlock lighting;
+  GetLighting(lighting);
+  if (memcmp(&lighting, &m_uploadedLighting, sizeof(lighting)) != 0 || !m_uniformsValid)
+  {
+    UploadLighting(lighting);
+    m_uploadedLighting = lighting;
+  }
+#if defined(ASTERWAVE_UNIFORM_BLOCK)
+  glBindBufferBase(GL_UNIFORM_BUFFER, ASTERWAVE_LIGHTING_BINDING, m_lightingUBO);
+#endif
+
+  // The grid of the displacement changes when the field is rebuilt
+  if (m_world.isVertexDisplacement && (m_gridDirty || !m_uniformsValid))
+  {
+    WaterField* field = m_world.waterField;
+    glUniform1i(m_heightMapLoc, 1);
+    glUniform4f(m_gridLoc, field->xMin(), field->yMin(),
+                (field->xMax() - field->xMin()) / field->XDivs(),
+                (field->yMax() - field->yMin()) / field->YDivs());
+    glUniform2f(m_gridSizeLoc, (float)field->XDivs(), (float)field->YDivs());
+    glUniform1f(m_normalSpreadLoc, (float)field->NormalParams().spread);
+    m_gridDirty = false;
+  }
 
+  m_uniformsValid = true;
   return true;
 }
 
@@ -13,7 +13,60 @@
 #include <kodi/gui/gl/Shader.h>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <atomic>
+#include <memory.h>
+
+#include "QualityGovernor.h"
+#include "ScaledTarget.h"
+#include "ShaderCache.h"
+#include "StreamBuffer.h"
+#include "ThreadPool.h"
 #include "waterfield.h"
+#include "watersolver.h"
+
+// Simulation step used in fixed step mode and the most steps done
+// for one rendered frame before the simulation falls behind.
+#define FIXED_STEP_TIME (1.0f/60.0f)
+#define MAX_STEPS_PER_FRAME 4
+
+// Seconds between the simulation statistics written to the debug log
+#define STATS_INTERVAL 10.0
+
+// Range of the subdivision picked by the quality governor, the same as
+// the one of the quality setting
+#define QUALITY_MIN_DIVS 50
+#define QUALITY_MAX_DIVS 150
+
+// Seconds of simulating and rendering per frame the governor aims for,
+// half a frame at 60 Hz leaves the rest to Kodi and the GPU
+#define QUALITY_FRAME_BUDGET 0.008
+
+// Displacing the mesh in the vertex shader needs float textures,
+// which GLES only has from version 3 on
+#if !defined(HAS_GLES) || HAS_GLES >= 3
+#define ASTERWAVE_VERTEX_DISPLACEMENT
+#endif
+
+// Vertex array objects came with GL 3 and GLES 3, without them the
+// attributes of the water are set up every frame
+#if !defined(HAS_GLES) || HAS_GLES >= 3
+#define ASTERWAVE_VERTEX_ARRAYS
+#endif
+
+// The light and the material go to the GL shaders in a uniform block,
+// GLES 2 and the #version 100 shaders of GLES 3 set them one by one
+#if !defined(HAS_GLES)
+#define ASTERWAVE_UNIFORM_BLOCK
+#define ASTERWAVE_LIGHTING_BINDING 0
+#endif
+
+// Normals are sent as signed 10_10_10_2 fractions, GLES 2 only takes
+// them as bytes
+#if !defined(HAS_GLES) || HAS_GLES >= 3
+#define ASTERWAVE_NORMAL_TYPE GL_INT_2_10_10_10_REV
+#else
+#define ASTERWAVE_NORMAL_TYPE GL_BYTE
+#endif
 
 void SetAnimation();
 
@@ -28,6 +81,11 @@ struct WaterSettings
   float scaleX;
   bool isWireframe;
   bool isTextureMode;
+  bool isFixedStep;
+  bool isThreadedSim;
+  bool isVertexDisplacement;
+  bool isVertexLighting;
+  bool isAdaptiveQuality;
   std::string szTextureSearchPath;
 };
 
@@ -57,7 +115,7 @@ struct sColor
 {
   sColor() : r(0.0f), g(0.0f), b(0.0f), a(1.0f) {}
   sColor(float r, float g, float b, float a = 1.0f) : r(r), g(g), b(b), a(a) {}
-  sColor(float* c) : r(c[0]), g(c[1]), b(c[2]), a(c[3]) {}
+  sColor(const float* c) : r(c[0]), g(c[1]), b(c[2]), a(c[3]) {}
   sColor& operator=(float* rhs)
   {
     r = rhs[0];
@@ -83,6 +141,68 @@ struct sLight
   sCoord coord;
 };
 
+// Position and texture coordinate of a grid point of the water, these
+// never change after WaterField::Init. The texture coordinate stays
+// within [0,1) and is kept as 16 bit fractions.
+struct sGridPoint
+{
+  float x, y;
+  uint16_t u, v;
+};
+
+// The part of a water vertex that changes from frame to frame, packed
+// into 12 bytes. The normal is made by PackNormal, the color is kept
+// in unsigned 8 bit fractions and so clamped to 1.
+struct sWaterVertex
+{
+  float height;
+  uint32_t normal;
+  uint8_t color[4];
+};
+
+inline uint8_t PackUnorm8(float value) { return (uint8_t)lrintf(iMax(0.0f, iMin(value, 1.0f)) * 255.0f); }
+inline uint16_t PackUnorm16(float value) { return (uint16_t)lrintf(iMax(0.0f, iMin(value, 1.0f)) * 65535.0f); }
+
+// Packs a unit normal in the ASTERWAVE_NORMAL_TYPE format
+inline uint32_t PackNormal(float x, float y, float z)
+{
+#if !defined(HAS_GLES) || HAS_GLES >= 3
+  return ((uint32_t)lrintf(x * 511.0f) & 0x3ff) |
+         ((uint32_t)lrintf(y * 511.0f) & 0x3ff) << 10 |
+         ((uint32_t)lrintf(z * 511.0f) & 0x3ff) << 20;
+#else
+  const int8_t bytes[4] = { (int8_t)lrintf(x * 127.0f), (int8_t)lrintf(y * 127.0f), (int8_t)lrintf(z * 127.0f), 0 };
+  uint32_t packed;
+  memcpy(&packed, bytes, sizeof(packed));
+  return packed;
+#endif
+}
+
+// Light and material as laid out in the std140 Lighting block of the
+// shaders
+struct sLightingBlock
+{
+  glm::vec4 lightPosition;
+  glm::vec4 lightAmbient;
+  glm::vec4 lightDiffuse;
+  glm::vec4 lightSpecular;
+  float lightConstantAttenuation;
+  float lightLinearAttenuation;
+  float lightQuadraticAttenuation;
+  float pad0;
+  glm::vec3 lightSpotDirection;
+  float lightSpotExponent;
+  float lightSpotCutoffAngleCos;
+  float pad1[3];
+  glm::vec4 materialAmbient;
+  glm::vec4 materialDiffuse;
+  glm::vec4 materialSpecular;
+  glm::vec4 materialEmission;
+  float materialShininess;
+  float pad2[3];
+};
+static_assert(sizeof(sLightingBlock) == 192, "sLightingBlock has to match the std140 layout");
+
 class ATTR_DLL_LOCAL CScreensaverAsterwave
   : public kodi::addon::CAddonBase,
     public kodi::addon::CInstanceScreensaver,
@@ -101,20 +221,41 @@ public:
   bool OnEnabled() override;
 
   void Draw(int primitive, const sLight* data, unsigned int size, bool withTexture);
+  void SetGridPoints(const sGridPoint* points, int xdivs, int ydivs);
+  sWaterVertex* BeginGrid();
+  void DrawGrid(bool withTexture);
 
 private:
   void SetDefaults();
+  void StepSimulation(float time);
+  int StepFixed(float frameTime);
+  void StartSimulationThread();
+  void StopSimulationThread();
+  void SimulationThread();
+  void RebuildField(int divs);
+  void LogStatistics(double currentTime);
   void SetCamera();
   void SetMaterial();
+  void GetLighting(sLightingBlock& lighting) const;
+  void UploadLighting(const sLightingBlock& lighting);
   void SetupRenderState();
   void CreateLight();
   void LoadTexture();
   void LoadEffects();
   void SetupGradientBackground(const CRGBA& dwTopColor, const CRGBA& dwBottomColor );
   void RenderGradientBackground();
+  void RenderDisplaced();
+  void CreateGrid(int xdivs, int ydivs);
+  void SetGridAttributes(size_t offset);
+  void DeleteGrid();
+  bool LoadShader(const std::string& vertShader, const std::string& fragShader,
+                  const std::string& vertHeader, const std::string& fragHeader);
+  GLuint Program() const { return m_cachedProgram != 0 ? m_cachedProgram : ProgramHandle(); }
+  void EnableProgram();
+  void DisableProgram();
 
-  glm::mat4 m_projMat;
-  glm::mat4 m_modelMat;
+  glm::mat4 m_projMat = glm::mat4(0.0f);
+  glm::mat4 m_modelMat = glm::mat4(0.0f);
   glm::mat3 m_normalMat;
   glm::vec4 m_materialAmbient;
   glm::vec4 m_materialDiffuse;
@@ -130,6 +271,17 @@ private:
   float m_lightQuatraticAttenuation;
   float m_shininess = 20.0f;
 
+  // What OnEnabled() last sent to the shader, only changes are sent
+  // again. Linking the shader makes everything stale.
+  bool m_uniformsValid = false;
+  bool m_matricesDirty = true;
+  bool m_gridDirty = true;
+  GLuint m_uploadedTextureId = 0;
+  float m_uploadedCoordNormalScale = 0.0f;
+  float m_uploadedHeightBlend = 0.0f;
+  sLightingBlock m_uploadedLighting;
+  GLuint m_lightingUBO = 0;
+
   GLint m_projMatLoc = -1;
   GLint m_modelViewMatLoc = -1;
   GLint m_transposeAdjointModelViewMatrixLoc = -1;
@@ -138,6 +290,14 @@ private:
   GLint m_hNormal = -1;
   GLint m_hCoord = -1;
   GLint m_hColor = -1;
+  GLint m_hHeight = -1;
+  GLint m_coordNormalScaleLoc = -1;
+  GLint m_hCell = -1;
+  GLint m_heightMapLoc = -1;
+  GLint m_gridLoc = -1;
+  GLint m_gridSizeLoc = -1;
+  GLint m_normalSpreadLoc = -1;
+  GLint m_heightBlendLoc = -1;
 
   GLint m_light0_ambientLoc = -1;
   GLint m_light0_diffuseLoc = -1;
@@ -163,10 +323,64 @@ private:
   BG_VERTEX m_BGVertices[4];
   double m_lastTime;
   double m_lastImageTime = 0;
+  float m_stepAccumulator = 0.0f;
+  double m_statsTime = 0;
+  long m_statsActiveTiles = 0;
+  int m_statsSteps = 0;
   bool m_startOK = false;
 
   GLuint m_vertexVBO = 0;
 
+  // Program loaded from the shader cache, CShaderProgram only knows the
+  // programs it linked itself
+  GLuint m_cachedProgram = 0;
+
+  // Percent of the output size the water is drawn at, 0 picks it from
+  // the output size
+  int m_renderScale = 0;
+  CScaledTarget m_scaledTarget;
+
+  // Triangle list over the grid points of the water, the points
+  // themselves and the vertices filled in for them every frame
+  GLuint m_gridIBO = 0;
+  GLuint m_gridPointVBO = 0;
+  GLsizei m_gridIndexCount = 0;
+  GLenum m_gridIndexType = GL_UNSIGNED_SHORT;
+  int m_gridXdivs = 0;
+  int m_gridYdivs = 0;
+  CStreamBuffer m_gridStream;
+#if defined(ASTERWAVE_VERTEX_ARRAYS)
+  GLuint m_gridVAOs[STREAM_BUFFER_REGIONS] = {};
+  GLint m_kodiVAO = 0;
+#endif
+  float m_coordNormalScale = 0.0f;
+
+  // Static grid and height map of the vertex displacement mode
+  GLuint m_gridVBO = 0;
+  GLuint m_gridColorVBO = 0;
+  GLuint m_heightTexture = 0;
+  float m_heightBlend = 1.0f;
+  std::vector<float> m_gridHeights;
+  std::vector<CRGBA> m_gridColors;
+
+  CThreadPool m_threadPool;
+  int m_threads = 0;
+
+  // With isThreadedSim the effects and the steps run on m_simThread,
+  // Render() only draws the latest snapshot of the water field
+  std::thread m_simThread;
+  std::mutex m_simMutex;
+  std::condition_variable m_simWake;
+  bool m_simStop = false;
+
+  // With isAdaptiveQuality the field is rebuilt at the subdivision
+  // m_governor picks from the time Render() and the steps take.
+  // m_stepTime adds up the seconds stepped since the last frame.
+  CQualityGovernor m_governor;
+  std::atomic<double> m_stepTime{0.0};
+
+  int m_solver = WATER_SOLVER_OPTIMIZED;
+
   float xmin = -10.0f;
   float xmax = 10.0f;
   float ymin = -10.0f;
@@ -18,11 +18,22 @@
 #include "waterfield.h"
 #include "Water.h"
 #include "Util.h"
+#include "waterkernels.h"
+#include "watersolver.h"
+#include <algorithm>
 #include <memory.h>
+#include <stdint.h>
 #include <vector>
 
+#define SNAPSHOT_FRESH 4
+
 WaterField::WaterField(CScreensaverAsterwave* base)
-  : m_base(base)
+  : m_base(base),
+    m_solverType(WATER_SOLVER_OPTIMIZED),
+    m_useSnapshots(false),
+    m_snapshotLatest(0),
+    m_snapshotBack(0),
+    m_snapshotFront(0)
 {
   Init(-10,10,-50,50,160,160, 10, 0.1f, 0.7f, 1.0f, 0.54f, false);
 }
@@ -31,7 +42,12 @@ WaterField::WaterField(CScreensaverAsterwave* base, float xmin, float xmax,
                        float ymin, float ymax, int xdivs, int ydivs,
                        float height, float elasticity, float viscosity,
                        float tension, float blendability, bool textureMode)
-  : m_base(base)
+  : m_base(base),
+    m_solverType(WATER_SOLVER_OPTIMIZED),
+    m_useSnapshots(false),
+    m_snapshotLatest(0),
+    m_snapshotBack(0),
+    m_snapshotFront(0)
 {
   Init(xmin, xmax, ymin, ymax, xdivs, ydivs, height, elasticity, viscosity, tension, blendability, textureMode);
 }
@@ -64,21 +80,214 @@ void WaterField::Init(float xmin, float xmax, float ymin, float ymax, int xdivs,
   m_tension = tension;
   m_blendability = blendability;
   m_textureMode = textureMode;
+  m_normalParams.spread = WATER_NORMAL_SPREAD;
+  m_normalParams.scaleX = -WATER_NORMAL_SPREAD*m_ydivdist;
+  m_normalParams.scaleY = 2*WATER_NORMAL_SPREAD*m_xdivdist;
+  m_normalParams.z = 4*WATER_NORMAL_SPREAD*WATER_NORMAL_SPREAD*m_xdivdist*m_ydivdist;
+  m_normalParams.xdivdist = m_xdivdist;
+  m_normalParams.ydivdist = m_ydivdist;
+  m_threadPool = nullptr;
+  m_renderAlpha = 1.0f;
+
+  // Every plane (height, previous height, velocity, normal x/y/z) gets
+  // its own slice of one block, the rows are padded to keep each row's
+  // first cell aligned.
+  const int floatsPerAlign = WATER_ALIGN / sizeof(float);
+  m_stride = (ydivs + floatsPerAlign - 1) / floatsPerAlign * floatsPerAlign;
+  const size_t planeSize = (size_t)xdivs * m_stride;
+  m_planeSize = planeSize;
+  m_storage.assign(6 * planeSize + floatsPerAlign, 0.0f);
+
+  float* base = m_storage.data();
+  base += (floatsPerAlign - ((uintptr_t)base / sizeof(float)) % floatsPerAlign) % floatsPerAlign;
+  m_height = base;
+  m_prevHeight = base + planeSize;
+  m_velocity = base + 2 * planeSize;
+  m_normalX = base + 3 * planeSize;
+  m_normalY = base + 4 * planeSize;
+  m_normalZ = base + 5 * planeSize;
+  for (size_t n = 0; n < planeSize; n++)
+    base[5 * planeSize + n] = 1.0f;
+
+  m_color.assign(planeSize, CRGBA(0x80,0x80,0x80,0xFF));
+  m_colors = m_color.data();
+  SetDrawPlanes(base, m_color.data());
+  if (m_useSnapshots)
+  {
+    m_useSnapshots = false;
+    EnableSnapshots(true);
+  }
+
+  CreateSolver();
+
+  // Only heights, normals and colors change from here on, the rest of
+  // the mesh is handed to the renderer once
+  std::vector<sGridPoint> points(myXdivs*myYdivs);
+  for (int i = 0; i < myXdivs; i++)
+    for (int j = 0; j < myYdivs; j++)
+    {
+      sGridPoint& point = points[i*myYdivs + j];
+      point.x = myXmin + (float)(i*m_xdivdist);
+      point.y = myYmin + (float)(j*m_ydivdist);
+      point.u = PackUnorm16((float)i/(float)myXdivs);
+      point.v = PackUnorm16((float)j/(float)myYdivs);
+    }
+  if (m_base)
+    m_base->SetGridPoints(points.data(), myXdivs, myYdivs);
+}
+
+void WaterField::SetDrawPlanes(float* planes, CRGBA* colors)
+{
+  m_drawHeight = planes;
+  m_drawPrevHeight = planes + m_planeSize;
+  m_drawNormalX = planes + 3 * m_planeSize;
+  m_drawNormalY = planes + 4 * m_planeSize;
+  m_drawNormalZ = planes + 5 * m_planeSize;
+  m_drawColors = colors;
+}
+
+void WaterField::EnableSnapshots(bool enable)
+{
+  if (enable == m_useSnapshots)
+    return;
+
+  m_useSnapshots = enable;
+  if (!enable)
+  {
+    SetDrawPlanes(m_height, m_color.data());
+    for (Snapshot& snapshot : m_snapshots)
+    {
+      snapshot.planes.clear();
+      snapshot.colors.clear();
+    }
+    return;
+  }
+
+  // Every buffer starts as a copy of the current state so the render
+  // side has something to draw before the first step is published
+  for (Snapshot& snapshot : m_snapshots)
+    CopyToSnapshot(snapshot, 0.0);
+  m_snapshotLatest = 1;
+  m_snapshotBack = 2;
+  m_snapshotFront = 0;
+  SetDrawPlanes(m_snapshots[0].planes.data(), m_snapshots[0].colors.data());
+}
+
+/************************************************************
+CopyToSnapshot
+
+Only the planes Render() reads are copied, the velocity plane
+slot is left unused to keep the layout of m_storage.
+************************************************************/
+void WaterField::CopyToSnapshot(Snapshot& snapshot, double time)
+{
+  const float* planes = m_height;
+  snapshot.planes.resize(6 * m_planeSize);
+  snapshot.colors.resize(m_color.size());
+  memcpy(snapshot.planes.data(), planes, 2 * m_planeSize * sizeof(float));
+  memcpy(snapshot.planes.data() + 3 * m_planeSize, planes + 3 * m_planeSize, 3 * m_planeSize * sizeof(float));
+  std::copy(m_color.begin(), m_color.end(), snapshot.colors.begin());
+  snapshot.time = time;
+}
+
+void WaterField::PublishSnapshot(double time)
+{
+  CopyToSnapshot(m_snapshots[m_snapshotBack], time);
+  m_snapshotBack = m_snapshotLatest.exchange(m_snapshotBack | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+}
+
+bool WaterField::AcquireSnapshot()
+{
+  if (!m_useSnapshots || !(m_snapshotLatest.load() & SNAPSHOT_FRESH))
+    return false;
+
+  m_snapshotFront = m_snapshotLatest.exchange(m_snapshotFront) & ~SNAPSHOT_FRESH;
+  Snapshot& snapshot = m_snapshots[m_snapshotFront];
+  SetDrawPlanes(snapshot.planes.data(), snapshot.colors.data());
+  return true;
+}
+
+void WaterField::SetSolver(int type)
+{
+  m_solver->ReadHeights();
+  m_solverType = type;
+  CreateSolver();
+}
+
+void WaterField::CreateSolver()
+{
+  m_solver = CreateWaterSolver(m_solverType);
+  if (m_solver->Init(*this))
+    return;
+
+  kodi::Log(ADDON_LOG_WARNING, "The %s water solver is not supported here, using the optimized one", m_solver->Name());
+  m_solverType = WATER_SOLVER_OPTIMIZED;
+  m_solver = CreateWaterSolver(m_solverType);
+  m_solver->Init(*this);
+}
+
+// Bilinear lookup in a plane, (i,j) is the cell above and left of the
+// point and (fi,fj) how far it is towards the next ones
+template<typename T, typename L>
+static T SamplePlane(const T* plane, int stride, int i, int j, float fi, float fj, L lerp)
+{
+  const T* row = plane + i*stride + j;
+  const T top = lerp(row[0], row[1], fj);
+  const T bottom = lerp(row[stride], row[stride+1], fj);
+  return lerp(top, bottom, fi);
+}
+
+static float LerpFloat(float a, float b, float ratio)
+{
+  return a + (b - a)*ratio;
+}
+
+/************************************************************
+Resample
 
-  myPoints = new WaterPoint*[xdivs];
-  for(int i = 0; i < xdivs; i++)
+The grid points of both fields span the same area, so point
+(i,j) here sits at (i*(otherXdivs-1)/(xdivs-1), ...) in other.
+Heights, velocities and normals are interpolated, which keeps
+the waves where they were when the subdivision changes.
+************************************************************/
+void WaterField::Resample(WaterField& other)
+{
+  other.Solver().ReadHeights();
+
+  const float scaleI = (float)(other.myXdivs - 1) / (float)(myXdivs - 1);
+  const float scaleJ = (float)(other.myYdivs - 1) / (float)(myYdivs - 1);
+  const int stride = other.m_stride;
+  for (int i = 0; i < myXdivs; i++)
   {
-    myPoints[i] = new WaterPoint[ydivs];
-    for(int j = 0; j < ydivs; j++)
+    const float si = i*scaleI;
+    const int oi = std::min((int)si, other.myXdivs - 2);
+    const float fi = si - oi;
+    for (int j = 0; j < myYdivs; j++)
     {
-      myPoints[i][j].height = 0;
-      myPoints[i][j].velocity = 0;
-      myPoints[i][j].color = CRGBA(0x80,0x80,0x80,0xFF);
-      myPoints[i][j].avecolor = CRGBA(0,0,0,255);
+      const float sj = j*scaleJ;
+      const int oj = std::min((int)sj, other.myYdivs - 2);
+      const float fj = sj - oj;
+      Height(i,j) = SamplePlane(other.m_height, stride, oi, oj, fi, fj, LerpFloat);
+      PrevHeight(i,j) = SamplePlane(other.m_prevHeight, stride, oi, oj, fi, fj, LerpFloat);
+      Velocity(i,j) = SamplePlane(other.m_velocity, stride, oi, oj, fi, fj, LerpFloat);
+      NormalX(i,j) = SamplePlane(other.m_normalX, stride, oi, oj, fi, fj, LerpFloat);
+      NormalY(i,j) = SamplePlane(other.m_normalY, stride, oi, oj, fi, fj, LerpFloat);
+      NormalZ(i,j) = SamplePlane(other.m_normalZ, stride, oi, oj, fi, fj, LerpFloat);
+      Color(i,j) = SamplePlane(other.m_colors, stride, oi, oj, fi, fj, CRGBA::Lerp);
     }
   }
 }
 
+int WaterField::ActiveTiles() const
+{
+  return m_solver->ActiveTiles();
+}
+
+int WaterField::TileCount() const
+{
+  return ((myXdivs + WATER_TILE_SIZE - 1) / WATER_TILE_SIZE) *
+         ((myYdivs + WATER_TILE_SIZE - 1) / WATER_TILE_SIZE);
+}
 
 void WaterField::DrawLine(float xStart, float yStart, float xEnd, float yEnd,
     float width, float newHeight, float strength, const CRGBA& color)
@@ -102,9 +311,8 @@ void WaterField::DrawLine(float xStart, float yStart, float xEnd, float yEnd,
           if(k*k+l*l <= radiusX*radiusY)
           {
             float ratio = 1.0f-sqrt((float)(k*k+l*l)/(float)(radiusX*radiusY));
-            myPoints[x+k][y+l].height = strength*newHeight + (1-strength)*myPoints[x+k][y+l].height;
-            myPoints[x+k][y+l].velocity = (1-strength)*myPoints[x+k][y+l].velocity;
-            myPoints[x+k][y+l].color = CRGBA::Lerp(myPoints[x+k][y+l].color, color, ratio);
+            m_solver->Stamp(x+k, y+l, strength, newHeight);
+            Color(x+k,y+l) = CRGBA::Lerp(Color(x+k,y+l), color, ratio);
           }
         }
   }
@@ -142,9 +350,8 @@ void WaterField::SetHeight(float xNearest, float yNearest,
         ratio = 1.0f-sqrt((float)((xNearest-x)*(xNearest-x)*yd*yd/xd/xd+(yNearest-y)*(yNearest-y))/(spread*spread));
         if (ratio <= 0)
           continue;
-        myPoints[i][j].height = ratio*newHeight + (1-ratio)*myPoints[i][j].height;
-        myPoints[i][j].velocity = (1-ratio)*myPoints[i][j].velocity;
-        myPoints[i][j].color = CRGBA::Lerp(myPoints[i][j].color, color, ratio);
+        m_solver->Stamp(i, j, ratio, newHeight);
+        Color(i,j) = CRGBA::Lerp(Color(i,j), color, ratio);
       }
 }
 
@@ -157,7 +364,7 @@ float WaterField::GetHeight(float xNearest, float yNearest)
 {
   int i,j;
   GetIndexNearestXY(xNearest,yNearest,&i,&j);
-  return myPoints[i][j].height;
+  return Height(i,j);
 }
 
 
@@ -166,113 +373,74 @@ void WaterField::Step()
   Step(STEP_TIME);
 }
 
-/************************************************************
-Step
-
-This is where knowledge of physical systems comes in handy.
-For every vertex the surface tension is computed as the
-cumulative sum of the difference between the vertex height and its
-neighbors.  This data is fed into the change in velocity.  The
-other values added are for damped oscillation (one is a proportional
-control and the other is differential) and so the three physical
-quantities accounted for are elasticity, viscosity, and surface tension.
-
-Height is just incremented by time*velocity.
-************************************************************/
 void WaterField::Step(float time)
 {
-  int i, j, k, l, mi, ni, mj, nj;
-  float cumulativeTension = 0;
-  int calRadius = 1;
-
-  for(i=0; i<myXdivs; i++)
-    for(j=0; j<myYdivs; j++)
-    {
-      cumulativeTension = 0;
-      myPoints[i][j].avecolor = CRGBA(0,0,0,0);
-      ni = i-calRadius > 0 ? i-calRadius : 0;//
-      ni = iMax(0,i-calRadius);
-      mi = iMin(myXdivs-1, i+calRadius);
-      nj = iMax(0,j-calRadius);
-      mj = iMin(myYdivs-1, j+calRadius);
-      for(k=ni; k<=mi; k++)
-        for(l=nj; l<=mj; l++)
-        {
-          cumulativeTension += myPoints[k][l].height- myPoints[i][j].height;
-        }
-
-      myPoints[i][j].velocity +=m_elasticity*(myHeight-myPoints[i][j].height)
-        - m_viscosity * myPoints[i][j].velocity
-        + m_tension*cumulativeTension;
-    }
-
-  for(i=0; i<myXdivs; i++)
-    for(j=0; j<myYdivs; j++)
-    {
-      myPoints[i][j].height += myPoints[i][j].velocity*time;
-      SetNormalForPoint(i,j);
-    }
+  m_solver->Step(time);
+}
 
+void WaterField::UpdateNormals(WaterNormalRowFunc kernel, int i, int jBegin, int jEnd)
+{
+  const int s = m_normalParams.spread;
+  const int iA = iMax(i-s, 0);
+  const int iB = iMin(i+s, myXdivs-1);
+  const float* rowA = HeightRow(iA);
+  const float* rowB = HeightRow(iB);
+  float* normalX = NormalXRow(i);
+  float* normalY = NormalYRow(i);
+  float* normalZ = NormalZRow(i);
+  auto clamped = [&](int begin, int end) {
+    WaterNormalRowClamped(rowA, rowB, iB-iA, normalX, normalY, normalZ, begin, end, myYdivs, m_normalParams);
+  };
+  if (i < s || i >= myXdivs-s)
+  {
+    clamped(jBegin, jEnd);
+    return;
+  }
+  WaterSplitRow(jBegin, jEnd, myYdivs, s, clamped, [&](int begin, int end) {
+    kernel(rowA, rowB, normalX, normalY, normalZ, begin, end, m_normalParams);
+  });
 }
 
 /************************************************************
 Render
 
 Renders the water to the screen relative to the currect origin.
-Doesnt do any translations on the matrix.  Each row is done
-in one individual triangular strip (so all interior vertices are
-done twice :-|  I do not believe it is possible to do it all
-as one triangular strip (and have every vertex specified once).
+Doesnt do any translations on the matrix.  Every grid point is
+written once and the whole mesh is drawn as one indexed
+triangle list, see CScreensaverAsterwave::DrawGrid. The grid
+positions and texture coordinates were handed over by Init,
+only heights, normals and colors are sent every frame.
 ************************************************************/
 void WaterField::Render()
 {
-  int i, j, k;
-
-  if (!m_textureMode)
+  static const CRGBA white(1.0f, 1.0f, 1.0f, 1.0f);
+  sWaterVertex* verts = m_base->BeginGrid();
+  for (int i = 0; i < myXdivs; i++)
   {
-    std::vector<sLight> verts(2*myYdivs);
-    for(i=0; i<myXdivs-1; i++)
+    for (int j = 0; j < myYdivs; j++)
     {
-      for(j=0; j<myYdivs; j++)
-      {
-        for (k=0; k<2; k++)
-        {
-          verts[2*j+k].vertex.x = myXmin + (float)((i+k)*m_xdivdist);
-          verts[2*j+k].vertex.y = myYmin + (float)(j*m_ydivdist);
-          verts[2*j+k].vertex.z = (float)(myPoints[i+k][j].height);
-          verts[2*j+k].normal.x = myPoints[i+k][j].normal.x;
-          verts[2*j+k].normal.y = myPoints[i+k][j].normal.y;
-          verts[2*j+k].normal.z = myPoints[i+k][j].normal.z;
-          verts[2*j+k].color = sColor(myPoints[i+k][j].color.col);
-        }
-      }
-      m_base->Draw(GL_TRIANGLE_STRIP, &verts[0], verts.size(), false);
-    }
-  }
-  else
-  {
-    std::vector<sLight> verts(2*myYdivs);
-    for(i=0; i<myXdivs-1; i++)
-    {
-      for(j=0; j<myYdivs; j++)
-      {
-        for (k=0; k<2; k++)
-        {
-          verts[2*j+k].vertex.x = myXmin + (float)((i+k)*m_xdivdist);
-          verts[2*j+k].vertex.y = myYmin + (float)(j*m_ydivdist);
-          verts[2*j+k].vertex.z = (float)(myPoints[i+k][j].height);
-          verts[2*j+k].normal.x = myPoints[i+k][j].normal.x;
-          verts[2*j+k].normal.y = myPoints[i+k][j].normal.y;
-          verts[2*j+k].normal.z = myPoints[i+k][j].normal.z;
-          verts[2*j+k].coord.u = 0.0f+1.0f*(float)(i+k)/(float)myXdivs + 0.5f*myPoints[i+k][j].normal.x;
-          verts[2*j+k].coord.v = 0.0f+1.0f*(float)j/(float)myYdivs + 0.5f*myPoints[i+k][j].normal.y;
-          verts[2*j+k].color = 1.0f;
-        }
-      }
-      // Draw it
-      m_base->Draw(GL_TRIANGLE_STRIP, &verts[0], verts.size(), true);
+      sWaterVertex& v = verts[i*myYdivs + j];
+      v.height = RenderHeight(i,j);
+      v.normal = PackNormal(DrawNormalX(i,j), DrawNormalY(i,j), DrawNormalZ(i,j));
+      const CRGBA& color = m_textureMode ? white : DrawColor(i,j);
+      for (int k = 0; k < 4; k++)
+        v.color[k] = PackUnorm8(color.col[k]);
     }
   }
+  m_base->DrawGrid(m_textureMode);
+}
+
+void WaterField::CopyRenderHeights(float* heights) const
+{
+  for (int i = 0; i < myXdivs; i++)
+    for (int j = 0; j < myYdivs; j++)
+      *heights++ = RenderHeight(i,j);
+}
+
+void WaterField::CopyRenderColors(CRGBA* colors) const
+{
+  for (int i = 0; i < myXdivs; i++)
+    colors = std::copy(m_drawColors + i*m_stride, m_drawColors + i*m_stride + myYdivs, colors);
 }
 
 /************************************************************
@@ -288,41 +456,3 @@ void WaterField::GetIndexNearestXY(float x, float y, int *i, int *j)
   *j = y <= myYmin ? 0: y >= myYmax ? myYdivs-1:
     (int)((float)myYdivs*(y - myYmin) / (myYmax - myYmin)) ;
 }
-
-/************************************************************
-SetNormalForPoint
-
-Calculates and sets a normal for any point ij in the water mesh
-by taking the normal to the plane that goes through three neighboring
-points.  This has the effect of smoothing out the lighting.
-************************************************************/
-void WaterField::SetNormalForPoint(int i, int j)
-{
-// Formula for the cross product p = v1 x v2
-//  p.x = v1.y * v2.z - v2.y * v1.z;
-//  p.y = v1.z * v2.x - v2.z * v1.x;
-//  p.z = v1.x * v2.y - v2.x * v1.y;
-
-//  these are the vectors to use.
-//   v1 = (bi-ai)*xdivdist, (bj-aj)*ydivdist, (myPoints[bi][bj].height-myPoints[ai][aj].height)
-//   v2 = (ci-ai)*xdivdist, (cj-aj)*ydivdist, (myPoints[ci][cj].height-myPoints[ai][aj].height)
-
-  CVector* norm = &(myPoints[i][j].normal);
-  CVector temp;
-  int s = 2; //spread
-  int mi = i > s ? i-s : 0;
-  int ni = i+s < myXdivs ? i+s : myXdivs-1;
-  int mj = j > s ? j-s : 0;
-  int nj = j+s < myYdivs ? j+s : myYdivs-1;
-
-  NormalForPoints(norm, mi,j,ni,mj,ni,nj);
-}
-
-CVector* WaterField::NormalForPoints(CVector* norm, int i, int j, int ai, int aj, int bi, int bj)
-{
-  CVector a = CVector((ai-i)*m_xdivdist, (aj-j)*m_ydivdist, (myPoints[ai][aj].height-myPoints[i][j].height));
-  CVector b = CVector((bi-i)*m_xdivdist, (bj-j)*m_ydivdist, (myPoints[bi][bj].height-myPoints[i][j].height));
-  norm->Cross(a,b);
-  norm->Normalize();
-  return norm;
-}
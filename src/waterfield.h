@@ -8,21 +8,31 @@
 
 #pragma once
 
+#include "ThreadPool.h"
 #include "Util.h"
 #include "types.h"
+#include "waterkernels.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
 
 #define STEP_TIME 0.1f
 
-struct WaterPoint
-{
-  float height;
-  float velocity;
-  CRGBA color;
-  CRGBA avecolor;
-  CVector normal;
-};
+// The texture coordinates of a grid point are moved along its normal
+// by this much, which gives the refraction of the texture mode
+#define WATER_REFRACTION 0.5f
+
+// Every plane row starts on a WATER_ALIGN byte boundary so the rows
+// can be streamed with aligned vector loads.
+#define WATER_ALIGN 32
+
+// The normals look this many cells away from the point they are
+// computed for
+#define WATER_NORMAL_SPREAD 2
 
 class CScreensaverAsterwave;
+class IWaterSolver;
 
 class WaterField
 {
@@ -38,16 +48,96 @@ public:
   void Render();
   void Step();
   void Step(float time);
+  void SetThreadPool(CThreadPool* pool) { m_threadPool = pool; }
+  CThreadPool* ThreadPool() const { return m_threadPool; }
+  // Hands the simulation over to the solver registered for type, see
+  // watersolver.h. The new solver carries on from the current state.
+  void SetSolver(int type);
+  IWaterSolver& Solver() { return *m_solver; }
+  // Takes over the water of other, a field over the same area at
+  // another subdivision, by interpolating all of its planes. Meant for
+  // a fresh field, before SetSolver() and EnableSnapshots().
+  void Resample(WaterField& other);
+  // Blend factor between the heights before and after the last Step()
+  // used by Render(), 1 draws the latest heights.
+  void SetRenderInterpolation(float alpha) { m_renderAlpha = alpha; }
+  float RenderInterpolation() const { return m_renderAlpha; }
+  // Lets a simulation thread hand its steps over to the render thread.
+  // PublishSnapshot copies what Render() draws into a spare buffer and
+  // makes it the latest, AcquireSnapshot switches Render() over to the
+  // latest one. With three buffers neither side ever waits for the
+  // other. time is stored along for the render interpolation.
+  void EnableSnapshots(bool enable);
+  void PublishSnapshot(double time);
+  bool AcquireSnapshot();
+  double SnapshotTime() const { return m_snapshots[m_snapshotFront].time; }
+  // Tiles simulated by the last Step() out of all tiles
+  int ActiveTiles() const;
+  int TileCount() const;
   float xMin(){return myXmin;}
   float xMax(){return myXmax;}
   float yMin(){return myYmin;}
   float yMax(){return myYmax;}
 
+  // Size and coefficients of the simulation, for the solvers
+  int XDivs() const { return myXdivs; }
+  int YDivs() const { return myYdivs; }
+  float RestHeight() const { return myHeight; }
+  WaterStepParams StepParams() const { return {myHeight, m_elasticity, m_viscosity, m_tension}; }
+  const WaterNormalParams& NormalParams() const { return m_normalParams; }
+
+  // Per cell accessors, the field is stored as one plane per quantity
+  // with row i (along x) holding the ydivs cells along y
+  int Stride() const { return m_stride; }
+  size_t PlaneSize() const { return m_planeSize; }
+  float& Height(int i, int j) { return m_height[i*m_stride + j]; }
+  float& PrevHeight(int i, int j) { return m_prevHeight[i*m_stride + j]; }
+  float& Velocity(int i, int j) { return m_velocity[i*m_stride + j]; }
+  float& NormalX(int i, int j) { return m_normalX[i*m_stride + j]; }
+  float& NormalY(int i, int j) { return m_normalY[i*m_stride + j]; }
+  float& NormalZ(int i, int j) { return m_normalZ[i*m_stride + j]; }
+  CRGBA& Color(int i, int j) { return m_colors[i*m_stride + j]; }
+  float* HeightRow(int i) { return m_height + i*m_stride; }
+  float* PrevHeightRow(int i) { return m_prevHeight + i*m_stride; }
+  float* VelocityRow(int i) { return m_velocity + i*m_stride; }
+  float* NormalXRow(int i) { return m_normalX + i*m_stride; }
+  float* NormalYRow(int i) { return m_normalY + i*m_stride; }
+  float* NormalZRow(int i) { return m_normalZ + i*m_stride; }
+  // Dense copies, row after row, of the heights and colors Render()
+  // draws, for renderers that build the mesh on their own
+  void CopyRenderHeights(float* heights) const;
+  void CopyRenderColors(CRGBA* colors) const;
+  float RenderHeight(int i, int j) const
+  {
+    const float height = m_drawHeight[i*m_stride + j];
+    if (m_renderAlpha >= 1.0f)
+      return height;
+    return InterpolateFloat(m_drawPrevHeight[i*m_stride + j], height, m_renderAlpha, true);
+  }
+
+  // Computes the normals of the cells [jBegin, jEnd) of row i from the
+  // heights. kernel gets the cells away from the border, the ones
+  // within the spread of it get the clamped points of
+  // WaterNormalRowClamped.
+  void UpdateNormals(WaterNormalRowFunc kernel, int i, int jBegin, int jEnd);
 
 private:
+  // Copy of the planes Render() reads, laid out like m_storage
+  struct Snapshot
+  {
+    std::vector<float> planes;
+    std::vector<CRGBA> colors;
+    double time = 0;
+  };
+
   void GetIndexNearestXY(float x, float y, int *i, int *j);
-  void SetNormalForPoint(int i, int j);
-  CVector* NormalForPoints(CVector* norm, int i, int j, int ai, int aj, int bi, int bj);
+  void CreateSolver();
+  void SetDrawPlanes(float* planes, CRGBA* colors);
+  void CopyToSnapshot(Snapshot& snapshot, double time);
+  float DrawNormalX(int i, int j) const { return m_drawNormalX[i*m_stride + j]; }
+  float DrawNormalY(int i, int j) const { return m_drawNormalY[i*m_stride + j]; }
+  float DrawNormalZ(int i, int j) const { return m_drawNormalZ[i*m_stride + j]; }
+  const CRGBA& DrawColor(int i, int j) const { return m_drawColors[i*m_stride + j]; }
   CScreensaverAsterwave* m_base;
   float myXmin;
   float myYmin;
@@ -63,5 +153,37 @@ private:
   float m_tension;
   float m_blendability;
   bool m_textureMode;
-  WaterPoint** myPoints;
+  WaterNormalParams m_normalParams;
+  CThreadPool* m_threadPool;
+  float m_renderAlpha;
+  int m_solverType;
+  std::unique_ptr<IWaterSolver> m_solver;
+
+  int m_stride;
+  size_t m_planeSize;
+  std::vector<float> m_storage;
+  std::vector<CRGBA> m_color;
+  CRGBA* m_colors;
+  float* m_height;
+  float* m_prevHeight;
+  float* m_velocity;
+  float* m_normalX;
+  float* m_normalY;
+  float* m_normalZ;
+
+  // Planes read by Render(), the live ones or the front snapshot
+  const float* m_drawHeight;
+  const float* m_drawPrevHeight;
+  const float* m_drawNormalX;
+  const float* m_drawNormalY;
+  const float* m_drawNormalZ;
+  const CRGBA* m_drawColors;
+
+  bool m_useSnapshots;
+  Snapshot m_snapshots[3];
+  // Index of the latest published snapshot, SNAPSHOT_FRESH is set
+  // until the render side picks it up
+  std::atomic<int> m_snapshotLatest;
+  int m_snapshotBack;
+  int m_snapshotFront;
 };
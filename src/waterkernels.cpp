@@ -0,0 +1,660 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *  Copyright (C) 2007 Asteron (http://asteron.projects.googlepages.com/home)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+//////////////////////////////////////////////////////////////////
+// WATERKERNELS.CPP
+//
+// Vectorized versions of the velocity update and the normal
+// generation done by WaterField::Step.  All velocity kernels sum
+// the neighbour differences in the same order as the scalar code,
+// so without fused multiply-add they give the same result bit for
+// bit.  The normal kernels use the approximate reciprocal square
+// root of the CPU refined by one Newton-Raphson step.  The fixed
+// point kernels only have a NEON version, the ARM boards without a
+// fast FPU are the ones they are meant for.
+//
+//////////////////////////////////////////////////////////////////
+
+#include "waterkernels.h"
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define WATER_KERNELS_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define WATER_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#define WATER_TARGET(isa)
+#else
+#define WATER_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+void WaterVelocityRowScalar(const float* up, const float* row, const float* down,
+                            float* velocity, int jBegin, int jEnd,
+                            const WaterStepParams& params)
+{
+  for (int j = jBegin; j < jEnd; j++)
+  {
+    const float c = row[j];
+    float cumulativeTension = 0;
+    cumulativeTension += up[j-1] - c;
+    cumulativeTension += up[j] - c;
+    cumulativeTension += up[j+1] - c;
+    cumulativeTension += row[j-1] - c;
+    cumulativeTension += row[j] - c;
+    cumulativeTension += row[j+1] - c;
+    cumulativeTension += down[j-1] - c;
+    cumulativeTension += down[j] - c;
+    cumulativeTension += down[j+1] - c;
+
+    velocity[j] += params.elasticity*(params.restHeight-c)
+      - params.viscosity * velocity[j]
+      + params.tension*cumulativeTension;
+  }
+}
+
+void WaterVelocityRowClamped(const float* up, const float* row, const float* down,
+                             float* velocity, int jBegin, int jEnd, int ydivs,
+                             const WaterStepParams& params)
+{
+  const float* rows[3] = {up, row, down};
+  for (int j = jBegin; j < jEnd; j++)
+  {
+    const float c = row[j];
+    const int lBegin = j > 0 ? j-1 : 0;
+    const int lEnd = j+1 < ydivs ? j+1 : ydivs-1;
+    float cumulativeTension = 0;
+    for (const float* k : rows)
+    {
+      if (!k)
+        continue;
+      for (int l = lBegin; l <= lEnd; l++)
+        cumulativeTension += k[l] - c;
+    }
+
+    velocity[j] += params.elasticity*(params.restHeight-c)
+      - params.viscosity * velocity[j]
+      + params.tension*cumulativeTension;
+  }
+}
+
+void WaterRowSum3(const float* row, float* sum, int jBegin, int jEnd)
+{
+  for (int j = jBegin; j < jEnd; j++)
+    sum[j] = row[j-1] + row[j] + row[j+1];
+}
+
+void WaterVelocityRowBoxSum(const float* sumUp, const float* sum, const float* sumDown,
+                            const float* row, float* velocity, int jBegin, int jEnd,
+                            const WaterStepParams& params)
+{
+  for (int j = jBegin; j < jEnd; j++)
+  {
+    const float c = row[j];
+    const float cumulativeTension = (sumUp[j] + sum[j] + sumDown[j]) - 9.0f*c;
+
+    velocity[j] += params.elasticity*(params.restHeight-c)
+      - params.viscosity * velocity[j]
+      + params.tension*cumulativeTension;
+  }
+}
+
+/************************************************************
+WaterNormalRowScalar
+
+The normal of cell (i,j) is the normal of the plane through
+the points p = (i-s,j), a = (i+s,j-s) and b = (i+s,j+s).
+
+Formula for the cross product n = (a-p) x (b-p)
+  n.x = v1.y * v2.z - v2.y * v1.z;
+  n.y = v1.z * v2.x - v2.z * v1.x;
+  n.z = v1.x * v2.y - v2.x * v1.y;
+
+with the vectors
+  v1 = 2s*xdivdist, -s*ydivdist, height[a]-height[p]
+  v2 = 2s*xdivdist,  s*ydivdist, height[b]-height[p]
+
+which only leaves the two height differences to be computed
+per cell:
+  n.x = -s*ydivdist * (v1.z + v2.z)
+  n.y = 2s*xdivdist * (v1.z - v2.z)
+  n.z = 4s*s*xdivdist*ydivdist
+************************************************************/
+void WaterNormalRowScalar(const float* rowA, const float* rowB,
+                          float* normalX, float* normalY, float* normalZ,
+                          int jBegin, int jEnd, const WaterNormalParams& params)
+{
+  const int s = params.spread;
+  for (int j = jBegin; j < jEnd; j++)
+  {
+    const float az = rowB[j-s] - rowA[j];
+    const float bz = rowB[j+s] - rowA[j];
+    const float x = params.scaleX * (az + bz);
+    const float y = params.scaleY * (az - bz);
+    const float invLength = 1.0f / sqrtf(x*x + y*y + params.z*params.z);
+    normalX[j] = x * invLength;
+    normalY[j] = y * invLength;
+    normalZ[j] = params.z * invLength;
+  }
+}
+
+void WaterNormalRowClamped(const float* rowA, const float* rowB, int rowSpan,
+                           float* normalX, float* normalY, float* normalZ,
+                           int jBegin, int jEnd, int ydivs, const WaterNormalParams& params)
+{
+  const int s = params.spread;
+  const float dx = rowSpan * params.xdivdist;
+  for (int j = jBegin; j < jEnd; j++)
+  {
+    const int mj = j > s ? j-s : 0;
+    const int nj = j+s < ydivs ? j+s : ydivs-1;
+    const float p = rowA[j];
+    const float ay = (mj-j) * params.ydivdist;
+    const float az = rowB[mj] - p;
+    const float by = (nj-j) * params.ydivdist;
+    const float bz = rowB[nj] - p;
+    const float x = ay*bz - by*az;
+    const float y = az*dx - bz*dx;
+    const float z = dx*by - dx*ay;
+    const double length = sqrt(x*x + y*y + z*z);
+    normalX[j] = (float)(x / length);
+    normalY[j] = (float)(y / length);
+    normalZ[j] = (float)(z / length);
+  }
+}
+
+static inline int16_t SaturateInt16(int32_t x)
+{
+  return (int16_t)(x < INT16_MIN ? INT16_MIN : x > INT16_MAX ? INT16_MAX : x);
+}
+
+static inline int16_t AddSat(int16_t a, int16_t b)
+{
+  return SaturateInt16((int32_t)a + b);
+}
+
+static inline int16_t SubSat(int16_t a, int16_t b)
+{
+  return SaturateInt16((int32_t)a - b);
+}
+
+// Rounded product of a and the Q15 factor b, as vqrdmulhq_s16
+static inline int16_t MulQ15(int16_t a, int16_t b)
+{
+  return SaturateInt16(((int32_t)a * b + (1 << 14)) >> 15);
+}
+
+// Neighbour height difference in the tension format, rounded as
+// vrshrq_n_s16
+static inline int16_t TensionTerm(int16_t n, int16_t c)
+{
+  const int shift = WATER_FIXED_HEIGHT_BITS - WATER_FIXED_TENSION_BITS;
+  return (int16_t)(((int32_t)SubSat(n, c) + (1 << (shift - 1))) >> shift);
+}
+
+// viscosity*v rounded away from zero. Rounding to nearest would leave
+// the small velocities undamped and the water would never settle.
+static inline int16_t Damping(int16_t v, int16_t viscosity)
+{
+  const int32_t magnitude = v == INT16_MIN ? INT16_MAX : v < 0 ? -v : v;
+  const int16_t damping = (int16_t)(((magnitude * viscosity) >> 15) + (v != 0));
+  return v < 0 ? -damping : damping;
+}
+
+static int16_t QuantizeFixed(float x, int bits)
+{
+  x = ldexpf(x, bits);
+  x = fminf(fmaxf(x, (float)INT16_MIN), (float)INT16_MAX);
+  return (int16_t)lrintf(x);
+}
+
+WaterFixedParams WaterQuantizeParams(const WaterStepParams& params)
+{
+  WaterFixedParams fixed;
+  fixed.restHeight = QuantizeFixed(params.restHeight, WATER_FIXED_HEIGHT_BITS);
+  fixed.elasticity = QuantizeFixed(params.elasticity, 15 + WATER_FIXED_VELOCITY_BITS - WATER_FIXED_HEIGHT_BITS);
+  fixed.viscosity = QuantizeFixed(params.viscosity, 15);
+  fixed.tension = QuantizeFixed(params.tension, 15 + WATER_FIXED_VELOCITY_BITS - WATER_FIXED_TENSION_BITS);
+  return fixed;
+}
+
+int16_t WaterQuantizeStepTime(float time)
+{
+  return QuantizeFixed(time, 15 + WATER_FIXED_HEIGHT_BITS - WATER_FIXED_VELOCITY_BITS);
+}
+
+/************************************************************
+WaterFixedVelocityRowScalar
+
+Same update as WaterVelocityRowScalar in int16.  The height
+differences are brought down to the tension scale before they
+are summed, which keeps the tension of a sharp crest within
+range.  Compared to the float engine the heights stay within
+WATER_FIXED_MAX_ERROR of it, but the fixed point water comes to
+rest a few height steps away from the rest height.
+************************************************************/
+void WaterFixedVelocityRowScalar(const int16_t* up, const int16_t* row, const int16_t* down,
+                                 int16_t* velocity, int jBegin, int jEnd,
+                                 const WaterFixedParams& params)
+{
+  for (int j = jBegin; j < jEnd; j++)
+  {
+    const int16_t c = row[j];
+    int16_t cumulativeTension = TensionTerm(up[j-1], c);
+    cumulativeTension = AddSat(cumulativeTension, TensionTerm(up[j], c));
+    cumulativeTension = AddSat(cumulativeTension, TensionTerm(up[j+1], c));
+    cumulativeTension = AddSat(cumulativeTension, TensionTerm(row[j-1], c));
+    cumulativeTension = AddSat(cumulativeTension, TensionTerm(row[j+1], c));
+    cumulativeTension = AddSat(cumulativeTension, TensionTerm(down[j-1], c));
+    cumulativeTension = AddSat(cumulativeTension, TensionTerm(down[j], c));
+    cumulativeTension = AddSat(cumulativeTension, TensionTerm(down[j+1], c));
+
+    const int16_t v = velocity[j];
+    int16_t dv = SubSat(MulQ15(SubSat(params.restHeight, c), params.elasticity),
+                        Damping(v, params.viscosity));
+    dv = AddSat(dv, MulQ15(cumulativeTension, params.tension));
+    velocity[j] = AddSat(v, dv);
+  }
+}
+
+void WaterFixedVelocityRowClamped(const int16_t* up, const int16_t* row, const int16_t* down,
+                                  int16_t* velocity, int jBegin, int jEnd, int ydivs,
+                                  const WaterFixedParams& params)
+{
+  const int16_t* rows[3] = {up, row, down};
+  for (int j = jBegin; j < jEnd; j++)
+  {
+    const int16_t c = row[j];
+    const int lBegin = j > 0 ? j-1 : 0;
+    const int lEnd = j+1 < ydivs ? j+1 : ydivs-1;
+    int16_t cumulativeTension = 0;
+    for (const int16_t* k : rows)
+    {
+      if (!k)
+        continue;
+      for (int l = lBegin; l <= lEnd; l++)
+        cumulativeTension = AddSat(cumulativeTension, TensionTerm(k[l], c));
+    }
+
+    const int16_t v = velocity[j];
+    int16_t dv = SubSat(MulQ15(SubSat(params.restHeight, c), params.elasticity),
+                        Damping(v, params.viscosity));
+    dv = AddSat(dv, MulQ15(cumulativeTension, params.tension));
+    velocity[j] = AddSat(v, dv);
+  }
+}
+
+void WaterFixedIntegrateRowScalar(int16_t* height, const int16_t* velocity,
+                                  float* floatHeight, float* prevHeight,
+                                  int jBegin, int jEnd, int16_t stepTime)
+{
+  const float scale = 1.0f / (1 << WATER_FIXED_HEIGHT_BITS);
+  for (int j = jBegin; j < jEnd; j++)
+  {
+    height[j] = AddSat(height[j], MulQ15(velocity[j], stepTime));
+    prevHeight[j] = floatHeight[j];
+    floatHeight[j] = height[j] * scale;
+  }
+}
+
+#if defined(WATER_KERNELS_X86)
+
+WATER_TARGET("sse2")
+static void WaterVelocityRowSSE2(const float* up, const float* row, const float* down,
+                                 float* velocity, int jBegin, int jEnd,
+                                 const WaterStepParams& params)
+{
+  const __m128 rest = _mm_set1_ps(params.restHeight);
+  const __m128 elasticity = _mm_set1_ps(params.elasticity);
+  const __m128 viscosity = _mm_set1_ps(params.viscosity);
+  const __m128 tension = _mm_set1_ps(params.tension);
+
+  int j = jBegin;
+  for (; j + 4 <= jEnd; j += 4)
+  {
+    const __m128 c = _mm_loadu_ps(row + j);
+    __m128 t = _mm_sub_ps(_mm_loadu_ps(up + j - 1), c);
+    t = _mm_add_ps(t, _mm_sub_ps(_mm_loadu_ps(up + j), c));
+    t = _mm_add_ps(t, _mm_sub_ps(_mm_loadu_ps(up + j + 1), c));
+    t = _mm_add_ps(t, _mm_sub_ps(_mm_loadu_ps(row + j - 1), c));
+    t = _mm_add_ps(t, _mm_sub_ps(c, c));
+    t = _mm_add_ps(t, _mm_sub_ps(_mm_loadu_ps(row + j + 1), c));
+    t = _mm_add_ps(t, _mm_sub_ps(_mm_loadu_ps(down + j - 1), c));
+    t = _mm_add_ps(t, _mm_sub_ps(_mm_loadu_ps(down + j), c));
+    t = _mm_add_ps(t, _mm_sub_ps(_mm_loadu_ps(down + j + 1), c));
+
+    __m128 v = _mm_loadu_ps(velocity + j);
+    __m128 dv = _mm_sub_ps(_mm_mul_ps(elasticity, _mm_sub_ps(rest, c)), _mm_mul_ps(viscosity, v));
+    dv = _mm_add_ps(dv, _mm_mul_ps(tension, t));
+    _mm_storeu_ps(velocity + j, _mm_add_ps(v, dv));
+  }
+  WaterVelocityRowScalar(up, row, down, velocity, j, jEnd, params);
+}
+
+WATER_TARGET("avx2")
+static void WaterVelocityRowAVX2(const float* up, const float* row, const float* down,
+                                 float* velocity, int jBegin, int jEnd,
+                                 const WaterStepParams& params)
+{
+  const __m256 rest = _mm256_set1_ps(params.restHeight);
+  const __m256 elasticity = _mm256_set1_ps(params.elasticity);
+  const __m256 viscosity = _mm256_set1_ps(params.viscosity);
+  const __m256 tension = _mm256_set1_ps(params.tension);
+
+  int j = jBegin;
+  for (; j + 8 <= jEnd; j += 8)
+  {
+    const __m256 c = _mm256_loadu_ps(row + j);
+    __m256 t = _mm256_sub_ps(_mm256_loadu_ps(up + j - 1), c);
+    t = _mm256_add_ps(t, _mm256_sub_ps(_mm256_loadu_ps(up + j), c));
+    t = _mm256_add_ps(t, _mm256_sub_ps(_mm256_loadu_ps(up + j + 1), c));
+    t = _mm256_add_ps(t, _mm256_sub_ps(_mm256_loadu_ps(row + j - 1), c));
+    t = _mm256_add_ps(t, _mm256_sub_ps(c, c));
+    t = _mm256_add_ps(t, _mm256_sub_ps(_mm256_loadu_ps(row + j + 1), c));
+    t = _mm256_add_ps(t, _mm256_sub_ps(_mm256_loadu_ps(down + j - 1), c));
+    t = _mm256_add_ps(t, _mm256_sub_ps(_mm256_loadu_ps(down + j), c));
+    t = _mm256_add_ps(t, _mm256_sub_ps(_mm256_loadu_ps(down + j + 1), c));
+
+    __m256 v = _mm256_loadu_ps(velocity + j);
+    __m256 dv = _mm256_sub_ps(_mm256_mul_ps(elasticity, _mm256_sub_ps(rest, c)), _mm256_mul_ps(viscosity, v));
+    dv = _mm256_add_ps(dv, _mm256_mul_ps(tension, t));
+    _mm256_storeu_ps(velocity + j, _mm256_add_ps(v, dv));
+  }
+  WaterVelocityRowSSE2(up, row, down, velocity, j, jEnd, params);
+}
+
+WATER_TARGET("sse2")
+static void WaterNormalRowSSE2(const float* rowA, const float* rowB,
+                               float* normalX, float* normalY, float* normalZ,
+                               int jBegin, int jEnd, const WaterNormalParams& params)
+{
+  const int s = params.spread;
+  const __m128 scaleX = _mm_set1_ps(params.scaleX);
+  const __m128 scaleY = _mm_set1_ps(params.scaleY);
+  const __m128 z = _mm_set1_ps(params.z);
+  const __m128 zz = _mm_set1_ps(params.z*params.z);
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 threeHalves = _mm_set1_ps(1.5f);
+
+  int j = jBegin;
+  for (; j + 4 <= jEnd; j += 4)
+  {
+    const __m128 p = _mm_loadu_ps(rowA + j);
+    const __m128 az = _mm_sub_ps(_mm_loadu_ps(rowB + j - s), p);
+    const __m128 bz = _mm_sub_ps(_mm_loadu_ps(rowB + j + s), p);
+    const __m128 x = _mm_mul_ps(scaleX, _mm_add_ps(az, bz));
+    const __m128 y = _mm_mul_ps(scaleY, _mm_sub_ps(az, bz));
+    const __m128 lengthSq = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), zz);
+
+    __m128 r = _mm_rsqrt_ps(lengthSq);
+    r = _mm_mul_ps(r, _mm_sub_ps(threeHalves, _mm_mul_ps(_mm_mul_ps(half, lengthSq), _mm_mul_ps(r, r))));
+
+    _mm_storeu_ps(normalX + j, _mm_mul_ps(x, r));
+    _mm_storeu_ps(normalY + j, _mm_mul_ps(y, r));
+    _mm_storeu_ps(normalZ + j, _mm_mul_ps(z, r));
+  }
+  WaterNormalRowScalar(rowA, rowB, normalX, normalY, normalZ, j, jEnd, params);
+}
+
+WATER_TARGET("avx2")
+static void WaterNormalRowAVX2(const float* rowA, const float* rowB,
+                               float* normalX, float* normalY, float* normalZ,
+                               int jBegin, int jEnd, const WaterNormalParams& params)
+{
+  const int s = params.spread;
+  const __m256 scaleX = _mm256_set1_ps(params.scaleX);
+  const __m256 scaleY = _mm256_set1_ps(params.scaleY);
+  const __m256 z = _mm256_set1_ps(params.z);
+  const __m256 zz = _mm256_set1_ps(params.z*params.z);
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 threeHalves = _mm256_set1_ps(1.5f);
+
+  int j = jBegin;
+  for (; j + 8 <= jEnd; j += 8)
+  {
+    const __m256 p = _mm256_loadu_ps(rowA + j);
+    const __m256 az = _mm256_sub_ps(_mm256_loadu_ps(rowB + j - s), p);
+    const __m256 bz = _mm256_sub_ps(_mm256_loadu_ps(rowB + j + s), p);
+    const __m256 x = _mm256_mul_ps(scaleX, _mm256_add_ps(az, bz));
+    const __m256 y = _mm256_mul_ps(scaleY, _mm256_sub_ps(az, bz));
+    const __m256 lengthSq = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), zz);
+
+    __m256 r = _mm256_rsqrt_ps(lengthSq);
+    r = _mm256_mul_ps(r, _mm256_sub_ps(threeHalves, _mm256_mul_ps(_mm256_mul_ps(half, lengthSq), _mm256_mul_ps(r, r))));
+
+    _mm256_storeu_ps(normalX + j, _mm256_mul_ps(x, r));
+    _mm256_storeu_ps(normalY + j, _mm256_mul_ps(y, r));
+    _mm256_storeu_ps(normalZ + j, _mm256_mul_ps(z, r));
+  }
+  WaterNormalRowSSE2(rowA, rowB, normalX, normalY, normalZ, j, jEnd, params);
+}
+
+static bool CPUHasAVX2()
+{
+#if defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)
+    return false;
+  __cpuid(info, 1);
+  const bool osxsave = (info[2] & (1 << 27)) != 0;
+  const bool avx = (info[2] & (1 << 28)) != 0;
+  if (!osxsave || !avx || (_xgetbv(0) & 0x6) != 0x6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return (info[1] & (1 << 5)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static bool CPUHasSSE2()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+  return true;
+#elif defined(_MSC_VER)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[3] & (1 << 26)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+#endif
+}
+
+#elif defined(WATER_KERNELS_NEON)
+
+static void WaterVelocityRowNEON(const float* up, const float* row, const float* down,
+                                 float* velocity, int jBegin, int jEnd,
+                                 const WaterStepParams& params)
+{
+  const float32x4_t rest = vdupq_n_f32(params.restHeight);
+  const float32x4_t elasticity = vdupq_n_f32(params.elasticity);
+  const float32x4_t viscosity = vdupq_n_f32(params.viscosity);
+  const float32x4_t tension = vdupq_n_f32(params.tension);
+
+  int j = jBegin;
+  for (; j + 4 <= jEnd; j += 4)
+  {
+    const float32x4_t c = vld1q_f32(row + j);
+    float32x4_t t = vsubq_f32(vld1q_f32(up + j - 1), c);
+    t = vaddq_f32(t, vsubq_f32(vld1q_f32(up + j), c));
+    t = vaddq_f32(t, vsubq_f32(vld1q_f32(up + j + 1), c));
+    t = vaddq_f32(t, vsubq_f32(vld1q_f32(row + j - 1), c));
+    t = vaddq_f32(t, vsubq_f32(c, c));
+    t = vaddq_f32(t, vsubq_f32(vld1q_f32(row + j + 1), c));
+    t = vaddq_f32(t, vsubq_f32(vld1q_f32(down + j - 1), c));
+    t = vaddq_f32(t, vsubq_f32(vld1q_f32(down + j), c));
+    t = vaddq_f32(t, vsubq_f32(vld1q_f32(down + j + 1), c));
+
+    float32x4_t v = vld1q_f32(velocity + j);
+    float32x4_t dv = vsubq_f32(vmulq_f32(elasticity, vsubq_f32(rest, c)), vmulq_f32(viscosity, v));
+    dv = vaddq_f32(dv, vmulq_f32(tension, t));
+    vst1q_f32(velocity + j, vaddq_f32(v, dv));
+  }
+  WaterVelocityRowScalar(up, row, down, velocity, j, jEnd, params);
+}
+
+static void WaterNormalRowNEON(const float* rowA, const float* rowB,
+                               float* normalX, float* normalY, float* normalZ,
+                               int jBegin, int jEnd, const WaterNormalParams& params)
+{
+  const int s = params.spread;
+  const float32x4_t scaleX = vdupq_n_f32(params.scaleX);
+  const float32x4_t scaleY = vdupq_n_f32(params.scaleY);
+  const float32x4_t z = vdupq_n_f32(params.z);
+  const float32x4_t zz = vdupq_n_f32(params.z*params.z);
+
+  int j = jBegin;
+  for (; j + 4 <= jEnd; j += 4)
+  {
+    const float32x4_t p = vld1q_f32(rowA + j);
+    const float32x4_t az = vsubq_f32(vld1q_f32(rowB + j - s), p);
+    const float32x4_t bz = vsubq_f32(vld1q_f32(rowB + j + s), p);
+    const float32x4_t x = vmulq_f32(scaleX, vaddq_f32(az, bz));
+    const float32x4_t y = vmulq_f32(scaleY, vsubq_f32(az, bz));
+    const float32x4_t lengthSq = vaddq_f32(vaddq_f32(vmulq_f32(x, x), vmulq_f32(y, y)), zz);
+
+    // vrsqrtsq_f32 computes (3 - a*b) / 2 for the Newton-Raphson step
+    float32x4_t r = vrsqrteq_f32(lengthSq);
+    r = vmulq_f32(r, vrsqrtsq_f32(vmulq_f32(lengthSq, r), r));
+
+    vst1q_f32(normalX + j, vmulq_f32(x, r));
+    vst1q_f32(normalY + j, vmulq_f32(y, r));
+    vst1q_f32(normalZ + j, vmulq_f32(z, r));
+  }
+  WaterNormalRowScalar(rowA, rowB, normalX, normalY, normalZ, j, jEnd, params);
+}
+
+// Eight cells per instruction, the saturating instructions match the
+// helpers used by WaterFixedVelocityRowScalar
+static void WaterFixedVelocityRowNEON(const int16_t* up, const int16_t* row, const int16_t* down,
+                                      int16_t* velocity, int jBegin, int jEnd,
+                                      const WaterFixedParams& params)
+{
+  const int shift = WATER_FIXED_HEIGHT_BITS - WATER_FIXED_TENSION_BITS;
+  const int16x8_t zero = vdupq_n_s16(0);
+  const int16x8_t rest = vdupq_n_s16(params.restHeight);
+  const int16x8_t elasticity = vdupq_n_s16(params.elasticity);
+  const int16x8_t viscosity = vdupq_n_s16(params.viscosity);
+  const int16x8_t tension = vdupq_n_s16(params.tension);
+
+  int j = jBegin;
+  for (; j + 8 <= jEnd; j += 8)
+  {
+    const int16x8_t c = vld1q_s16(row + j);
+    int16x8_t t = vrshrq_n_s16(vqsubq_s16(vld1q_s16(up + j - 1), c), shift);
+    t = vqaddq_s16(t, vrshrq_n_s16(vqsubq_s16(vld1q_s16(up + j), c), shift));
+    t = vqaddq_s16(t, vrshrq_n_s16(vqsubq_s16(vld1q_s16(up + j + 1), c), shift));
+    t = vqaddq_s16(t, vrshrq_n_s16(vqsubq_s16(vld1q_s16(row + j - 1), c), shift));
+    t = vqaddq_s16(t, vrshrq_n_s16(vqsubq_s16(vld1q_s16(row + j + 1), c), shift));
+    t = vqaddq_s16(t, vrshrq_n_s16(vqsubq_s16(vld1q_s16(down + j - 1), c), shift));
+    t = vqaddq_s16(t, vrshrq_n_s16(vqsubq_s16(vld1q_s16(down + j), c), shift));
+    t = vqaddq_s16(t, vrshrq_n_s16(vqsubq_s16(vld1q_s16(down + j + 1), c), shift));
+
+    // Damping: vqdmulhq_s16 truncates, subtracting the all ones
+    // vtstq_s16 mask adds one for every moving cell
+    const int16x8_t v = vld1q_s16(velocity + j);
+    int16x8_t damping = vqdmulhq_s16(vqabsq_s16(v), viscosity);
+    damping = vsubq_s16(damping, vreinterpretq_s16_u16(vtstq_s16(v, v)));
+    damping = vbslq_s16(vcltq_s16(v, zero), vnegq_s16(damping), damping);
+
+    int16x8_t dv = vqsubq_s16(vqrdmulhq_s16(vqsubq_s16(rest, c), elasticity), damping);
+    dv = vqaddq_s16(dv, vqrdmulhq_s16(t, tension));
+    vst1q_s16(velocity + j, vqaddq_s16(v, dv));
+  }
+  WaterFixedVelocityRowScalar(up, row, down, velocity, j, jEnd, params);
+}
+
+static void WaterFixedIntegrateRowNEON(int16_t* height, const int16_t* velocity,
+                                       float* floatHeight, float* prevHeight,
+                                       int jBegin, int jEnd, int16_t stepTime)
+{
+  const int16x8_t dt = vdupq_n_s16(stepTime);
+
+  int j = jBegin;
+  for (; j + 8 <= jEnd; j += 8)
+  {
+    const int16x8_t h = vqaddq_s16(vld1q_s16(height + j), vqrdmulhq_s16(vld1q_s16(velocity + j), dt));
+    vst1q_s16(height + j, h);
+    vst1q_f32(prevHeight + j, vld1q_f32(floatHeight + j));
+    vst1q_f32(prevHeight + j + 4, vld1q_f32(floatHeight + j + 4));
+    vst1q_f32(floatHeight + j, vcvtq_n_f32_s32(vmovl_s16(vget_low_s16(h)), WATER_FIXED_HEIGHT_BITS));
+    vst1q_f32(floatHeight + j + 4, vcvtq_n_f32_s32(vmovl_s16(vget_high_s16(h)), WATER_FIXED_HEIGHT_BITS));
+  }
+  WaterFixedIntegrateRowScalar(height, velocity, floatHeight, prevHeight, j, jEnd, stepTime);
+}
+
+#endif
+
+struct KernelChoice
+{
+  WaterVelocityRowFunc velocity;
+  WaterNormalRowFunc normal;
+  WaterFixedVelocityRowFunc fixedVelocity;
+  WaterFixedIntegrateRowFunc fixedIntegrate;
+  const char* name;
+};
+
+static KernelChoice DetectKernel()
+{
+#if defined(WATER_KERNELS_X86)
+  if (CPUHasAVX2())
+    return {WaterVelocityRowAVX2, WaterNormalRowAVX2,
+            WaterFixedVelocityRowScalar, WaterFixedIntegrateRowScalar, "AVX2"};
+  if (CPUHasSSE2())
+    return {WaterVelocityRowSSE2, WaterNormalRowSSE2,
+            WaterFixedVelocityRowScalar, WaterFixedIntegrateRowScalar, "SSE2"};
+#elif defined(WATER_KERNELS_NEON)
+  // NEON is part of the target ISA when the compiler defines
+  // __ARM_NEON, so there is nothing left to detect at runtime.
+  return {WaterVelocityRowNEON, WaterNormalRowNEON,
+          WaterFixedVelocityRowNEON, WaterFixedIntegrateRowNEON, "NEON"};
+#endif
+  return {WaterVelocityRowScalar, WaterNormalRowScalar,
+          WaterFixedVelocityRowScalar, WaterFixedIntegrateRowScalar, "scalar"};
+}
+
+static const KernelChoice& SelectedKernel()
+{
+  static const KernelChoice choice = DetectKernel();
+  return choice;
+}
+
+WaterVelocityRowFunc GetWaterVelocityRowKernel()
+{
+  return SelectedKernel().velocity;
+}
+
+WaterNormalRowFunc GetWaterNormalRowKernel()
+{
+  return SelectedKernel().normal;
+}
+
+WaterFixedVelocityRowFunc GetWaterFixedVelocityRowKernel()
+{
+  return SelectedKernel().fixedVelocity;
+}
+
+WaterFixedIntegrateRowFunc GetWaterFixedIntegrateRowKernel()
+{
+  return SelectedKernel().fixedIntegrate;
+}
+
+const char* GetWaterKernelName()
+{
+  return SelectedKernel().name;
+}
@@ -0,0 +1,155 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *  Copyright (C) 2007 Asteron (http://asteron.projects.googlepages.com/home)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+struct WaterStepParams
+{
+  float restHeight;
+  float elasticity;
+  float viscosity;
+  float tension;
+};
+
+struct WaterNormalParams
+{
+  int spread;     // cells between the points the normal plane goes through
+  float scaleX;   // -spread*ydivdist
+  float scaleY;   // 2*spread*xdivdist
+  float z;        // 4*spread*spread*xdivdist*ydivdist
+  float xdivdist; // distance between the rows
+  float ydivdist; // distance between the cells of a row
+};
+
+// Splits the cells [jBegin, jEnd) of a row of ydivs cells into the ones
+// within margin of either end, handed to edge, and the ones between,
+// handed to inner
+template<typename Edge, typename Inner>
+inline void WaterSplitRow(int jBegin, int jEnd, int ydivs, int margin, Edge edge, Inner inner)
+{
+  const int innerBegin = jBegin > margin ? jBegin : margin < jEnd ? margin : jEnd;
+  const int innerEnd = jEnd < ydivs - margin ? jEnd : ydivs - margin > innerBegin ? ydivs - margin : innerBegin;
+  if (jBegin < innerBegin)
+    edge(jBegin, innerBegin);
+  if (innerBegin < innerEnd)
+    inner(innerBegin, innerEnd);
+  if (innerEnd < jEnd)
+    edge(innerEnd, jEnd);
+}
+
+// Updates the velocity of the cells [jBegin, jEnd) of one row from the
+// full 3x3 neighbourhood found in the rows above, at and below it.
+// Only meant for cells away from the border of the field, which have
+// all of their neighbours.
+typedef void (*WaterVelocityRowFunc)(const float* up, const float* row, const float* down,
+                                     float* velocity, int jBegin, int jEnd,
+                                     const WaterStepParams& params);
+
+// Plain C++ version, used as reference and on CPUs without a vector unit.
+void WaterVelocityRowScalar(const float* up, const float* row, const float* down,
+                            float* velocity, int jBegin, int jEnd,
+                            const WaterStepParams& params);
+
+// The update of the original WaterField::Step for a row of ydivs
+// cells: only the neighbours inside the field count towards the
+// tension. up is null for the first row of the field and down for the
+// last. The reference solver does every cell this way, the others the
+// cells on the border.
+void WaterVelocityRowClamped(const float* up, const float* row, const float* down,
+                             float* velocity, int jBegin, int jEnd, int ydivs,
+                             const WaterStepParams& params);
+
+// Separable form of the same update: the tension is the 3x3 box sum
+// minus nine times the cell, built from horizontal 3-sums of the three
+// rows so every row sum is reused by the two rows next to it.
+void WaterRowSum3(const float* row, float* sum, int jBegin, int jEnd);
+void WaterVelocityRowBoxSum(const float* sumUp, const float* sum, const float* sumDown,
+                            const float* row, float* velocity, int jBegin, int jEnd,
+                            const WaterStepParams& params);
+
+// Computes the unit normals of the cells [jBegin, jEnd) of row i from
+// the rows spread above (rowA) and below (rowB) it, see
+// WaterNormalRowScalar for the derivation. Only meant for cells at
+// least spread cells away from the border of the field.
+typedef void (*WaterNormalRowFunc)(const float* rowA, const float* rowB,
+                                   float* normalX, float* normalY, float* normalZ,
+                                   int jBegin, int jEnd, const WaterNormalParams& params);
+
+void WaterNormalRowScalar(const float* rowA, const float* rowB,
+                          float* normalX, float* normalY, float* normalZ,
+                          int jBegin, int jEnd, const WaterNormalParams& params);
+
+// The normals of the original SetNormalForPoint for a row of ydivs
+// cells, which clamps the three points into the field. rowA and rowB
+// are the rows spread above and below, clamped into the field, and
+// rowSpan is the number of rows between them. Near the border the
+// normal comes from a narrower plane, away from it this gives what
+// WaterNormalRowScalar does.
+void WaterNormalRowClamped(const float* rowA, const float* rowB, int rowSpan,
+                           float* normalX, float* normalY, float* normalZ,
+                           int jBegin, int jEnd, int ydivs, const WaterNormalParams& params);
+
+// Fixed point version of the velocity update and the integration for
+// CPUs with a weak FPU. Heights are int16 with WATER_FIXED_HEIGHT_BITS
+// fractional bits (range +-8), velocities with WATER_FIXED_VELOCITY_BITS
+// (range +-128), which leaves headroom over what the effects produce.
+// The tension is summed with WATER_FIXED_TENSION_BITS (range +-32).
+// Every intermediate is saturated to int16 the way the NEON saturating
+// instructions do, so the scalar and NEON kernels agree bit for bit.
+#define WATER_FIXED_HEIGHT_BITS 12
+#define WATER_FIXED_VELOCITY_BITS 8
+#define WATER_FIXED_TENSION_BITS 10
+// Largest height difference to the float engine tests/fixedpointtest.cpp
+// accepts over its 3000 steps of splashes, about 0.018 is reached
+#define WATER_FIXED_MAX_ERROR 0.025f
+
+struct WaterFixedParams
+{
+  int16_t restHeight; // height format
+  int16_t elasticity; // Q15, scaled from the height to the velocity format
+  int16_t viscosity;  // Q15
+  int16_t tension;    // Q15, scaled from the tension to the velocity format
+};
+
+// Quantizes the float coefficients, done once when the field is set up
+WaterFixedParams WaterQuantizeParams(const WaterStepParams& params);
+// Q15 factor taking velocities to height increments for one step of
+// time seconds, steps are capped just below 1/16 s
+int16_t WaterQuantizeStepTime(float time);
+
+typedef void (*WaterFixedVelocityRowFunc)(const int16_t* up, const int16_t* row, const int16_t* down,
+                                          int16_t* velocity, int jBegin, int jEnd,
+                                          const WaterFixedParams& params);
+
+// Moves the heights of the cells [jBegin, jEnd) forward by one step and
+// writes them out as floats, the float heights before the step go to
+// prevHeight.
+typedef void (*WaterFixedIntegrateRowFunc)(int16_t* height, const int16_t* velocity,
+                                           float* floatHeight, float* prevHeight,
+                                           int jBegin, int jEnd, int16_t stepTime);
+
+void WaterFixedVelocityRowScalar(const int16_t* up, const int16_t* row, const int16_t* down,
+                                 int16_t* velocity, int jBegin, int jEnd,
+                                 const WaterFixedParams& params);
+// Same for the border cells, see WaterVelocityRowClamped
+void WaterFixedVelocityRowClamped(const int16_t* up, const int16_t* row, const int16_t* down,
+                                  int16_t* velocity, int jBegin, int jEnd, int ydivs,
+                                  const WaterFixedParams& params);
+void WaterFixedIntegrateRowScalar(int16_t* height, const int16_t* velocity,
+                                  float* floatHeight, float* prevHeight,
+                                  int jBegin, int jEnd, int16_t stepTime);
+
+// Returns the fastest kernels supported by the running CPU, the
+// detection is done once on first use.
+WaterVelocityRowFunc GetWaterVelocityRowKernel();
+WaterNormalRowFunc GetWaterNormalRowKernel();
+WaterFixedVelocityRowFunc GetWaterFixedVelocityRowKernel();
+WaterFixedIntegrateRowFunc GetWaterFixedIntegrateRowKernel();
+const char* GetWaterKernelName();
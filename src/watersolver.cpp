@@ -0,0 +1,572 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *  Copyright (C) 2007 Asteron (http://asteron.projects.googlepages.com/home)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+//////////////////////////////////////////////////////////////////
+// WATERSOLVER.CPP
+//
+// The solvers that move the water of a WaterField forward.  They
+// all implement the same physics, see WaterSolverReference::Step,
+// and only differ in how the work is done.
+//
+//////////////////////////////////////////////////////////////////
+
+#include "watersolver.h"
+#include "watersolvergpu.h"
+#include "waterfield.h"
+
+#include <math.h>
+#include <stdint.h>
+
+std::unique_ptr<IWaterSolver> CreateWaterSolver(int type)
+{
+  switch (type)
+  {
+    case WATER_SOLVER_FIXED:
+      return std::unique_ptr<IWaterSolver>(new WaterSolverFixed);
+    case WATER_SOLVER_REFERENCE:
+      return std::unique_ptr<IWaterSolver>(new WaterSolverReference);
+#if defined(WATER_HAS_GPU_SOLVER)
+    case WATER_SOLVER_GPU:
+      return std::unique_ptr<IWaterSolver>(new WaterSolverGpu);
+#endif
+    case WATER_SOLVER_OPTIMIZED:
+    default:
+      return std::unique_ptr<IWaterSolver>(new WaterSolverOptimized);
+  }
+}
+
+bool WaterSolverReference::Init(WaterField& field)
+{
+  m_field = &field;
+  return true;
+}
+
+/************************************************************
+Step
+
+This is where knowledge of physical systems comes in handy.
+For every vertex the surface tension is computed as the
+cumulative sum of the difference between the vertex height and its
+neighbors.  This data is fed into the change in velocity.  The
+other values added are for damped oscillation (one is a proportional
+control and the other is differential) and so the three physical
+quantities accounted for are elasticity, viscosity, and surface tension.
+
+Height is just incremented by time*velocity.
+
+Only the neighbours inside the field take part, so the cells on
+the border feel the tension of fewer neighbours and their
+normals come from a narrower plane.
+************************************************************/
+void WaterSolverReference::Step(float time)
+{
+  WaterField& field = *m_field;
+  const WaterStepParams params = field.StepParams();
+  const int xdivs = field.XDivs();
+  const int ydivs = field.YDivs();
+
+  for (int i = 0; i < xdivs; i++)
+    WaterVelocityRowClamped(i > 0 ? field.HeightRow(i-1) : nullptr, field.HeightRow(i),
+                            i < xdivs-1 ? field.HeightRow(i+1) : nullptr,
+                            field.VelocityRow(i), 0, ydivs, ydivs, params);
+
+  for (int i = 0; i < xdivs; i++)
+  {
+    float* h = field.HeightRow(i);
+    float* prev = field.PrevHeightRow(i);
+    const float* v = field.VelocityRow(i);
+    for (int j = 0; j < ydivs; j++)
+    {
+      prev[j] = h[j];
+      h[j] += v[j]*time;
+    }
+  }
+
+  const WaterNormalParams& normalParams = field.NormalParams();
+  const int s = normalParams.spread;
+  for (int i = 0; i < xdivs; i++)
+  {
+    const int iA = iMax(i-s, 0);
+    const int iB = iMin(i+s, xdivs-1);
+    WaterNormalRowClamped(field.HeightRow(iA), field.HeightRow(iB), iB-iA, field.NormalXRow(i),
+                          field.NormalYRow(i), field.NormalZRow(i), 0, ydivs, ydivs, normalParams);
+  }
+}
+
+void WaterSolverReference::Stamp(int i, int j, float weight, float newHeight)
+{
+  m_field->Height(i,j) = weight*newHeight + (1-weight)*m_field->Height(i,j);
+  m_field->Velocity(i,j) = (1-weight)*m_field->Velocity(i,j);
+}
+
+int WaterSolverReference::ActiveTiles() const
+{
+  return m_field->TileCount();
+}
+
+bool WaterSolverOptimized::Init(WaterField& field)
+{
+  m_field = &field;
+  m_velocityKernel = GetWaterVelocityRowKernel();
+  m_normalKernel = GetWaterNormalRowKernel();
+
+  // Everything starts active, cells away from the rest height settle
+  // on their own before their tiles get frozen.
+  m_tilesX = (field.XDivs() + WATER_TILE_SIZE - 1) / WATER_TILE_SIZE;
+  m_tilesY = (field.YDivs() + WATER_TILE_SIZE - 1) / WATER_TILE_SIZE;
+  m_tileActive.assign(m_tilesX*m_tilesY, 1);
+  m_tileStep.assign(m_tilesX*m_tilesY, 0);
+  m_tileNormal.assign(m_tilesX*m_tilesY, 0);
+  m_tileEnergy.assign(m_tilesX*m_tilesY, 0.0f);
+  m_normalPending.assign(field.XDivs(), 0);
+  m_activeTiles = m_tilesX*m_tilesY;
+  return true;
+}
+
+/************************************************************
+Step
+
+Same as WaterSolverReference::Step, only the tiles that move or
+border on moving ones are worked on, in row bands spread over the
+thread pool of the field.
+************************************************************/
+void WaterSolverOptimized::Step(float time)
+{
+  const WaterStepParams params = m_field->StepParams();
+
+  UpdateWorkTiles();
+
+  // The passes are split into row bands for the thread pool, returning
+  // from RunRows is the barrier between them. Bands read one row past
+  // their edges while computing velocities, so heights are only updated
+  // in the second pass.
+  RunRows([&](int begin, int end) { StepVelocityRows(begin, end, params); });
+  RunRows([&](int begin, int end) { IntegrateAndNormalRows(begin, end, time); });
+
+  // Normals next to the band edges needed rows of the neighbouring band
+  for (int i = 0; i < m_field->XDivs(); i++)
+  {
+    if (m_normalPending[i])
+    {
+      NormalRow(i);
+      m_normalPending[i] = 0;
+    }
+  }
+
+  UpdateActiveTiles();
+}
+
+void WaterSolverOptimized::Stamp(int i, int j, float weight, float newHeight)
+{
+  MarkActive(i,j);
+  m_field->Height(i,j) = weight*newHeight + (1-weight)*m_field->Height(i,j);
+  m_field->Velocity(i,j) = (1-weight)*m_field->Velocity(i,j);
+}
+
+/************************************************************
+UpdateWorkTiles
+
+Decides which tiles are worked on this step.  Waves travel at
+most one cell per step, so every tile next to an active one is
+stepped as well, and normals are refreshed one tile further out
+since they look two cells across the tile edge.
+************************************************************/
+void WaterSolverOptimized::UpdateWorkTiles()
+{
+  const int count = m_tilesX*m_tilesY;
+  for (int t = 0; t < count; t++)
+    m_tileStep[t] = m_tileNormal[t] = 0;
+
+  m_activeTiles = 0;
+  for (int ti = 0; ti < m_tilesX; ti++)
+    for (int tj = 0; tj < m_tilesY; tj++)
+    {
+      if (!m_tileActive[ti*m_tilesY + tj])
+        continue;
+      for (int k = iMax(0, ti-1); k <= iMin(m_tilesX-1, ti+1); k++)
+        for (int l = iMax(0, tj-1); l <= iMin(m_tilesY-1, tj+1); l++)
+          m_tileStep[k*m_tilesY + l] = 1;
+    }
+
+  for (int ti = 0; ti < m_tilesX; ti++)
+    for (int tj = 0; tj < m_tilesY; tj++)
+    {
+      if (!m_tileStep[ti*m_tilesY + tj])
+        continue;
+      m_activeTiles++;
+      m_tileEnergy[ti*m_tilesY + tj] = 0;
+      for (int k = iMax(0, ti-1); k <= iMin(m_tilesX-1, ti+1); k++)
+        for (int l = iMax(0, tj-1); l <= iMin(m_tilesY-1, tj+1); l++)
+          m_tileNormal[k*m_tilesY + l] = 1;
+    }
+}
+
+/************************************************************
+UpdateActiveTiles
+
+Keeps the tiles whose cells still move or sit away from the
+rest height active.  Tiles that come to rest are settled on the
+rest height and frozen until something disturbs them again.
+************************************************************/
+void WaterSolverOptimized::UpdateActiveTiles()
+{
+  const int xdivs = m_field->XDivs();
+  const int ydivs = m_field->YDivs();
+  for (int ti = 0; ti < m_tilesX; ti++)
+    for (int tj = 0; tj < m_tilesY; tj++)
+    {
+      const int t = ti*m_tilesY + tj;
+      if (!m_tileStep[t])
+        continue;
+      const bool active = m_tileEnergy[t] > m_restThreshold;
+      if (!active && m_tileActive[t])
+      {
+        for (int i = ti*WATER_TILE_SIZE; i < iMin(xdivs, (ti+1)*WATER_TILE_SIZE); i++)
+          for (int j = tj*WATER_TILE_SIZE; j < iMin(ydivs, (tj+1)*WATER_TILE_SIZE); j++)
+          {
+            Stamp(i, j, 1.0f, m_field->RestHeight());
+            m_field->PrevHeight(i,j) = m_field->Height(i,j);
+          }
+      }
+      m_tileActive[t] = active;
+    }
+}
+
+void WaterSolverOptimized::MarkActive(int i, int j)
+{
+  m_tileActive[(i/WATER_TILE_SIZE)*m_tilesY + j/WATER_TILE_SIZE] = 1;
+}
+
+void WaterSolverOptimized::RunRows(const CThreadPool::BandTask& task)
+{
+  // Bands always hold whole rows of tiles so that the per tile
+  // energy is only ever updated by one thread.
+  const int xdivs = m_field->XDivs();
+  auto tileRows = [&](int begin, int end) {
+    task(begin*WATER_TILE_SIZE, iMin(xdivs, end*WATER_TILE_SIZE));
+  };
+  if (m_field->ThreadPool())
+    m_field->ThreadPool()->Run(m_tilesX, 1, tileRows);
+  else
+    tileRows(0, m_tilesX);
+}
+
+void WaterSolverOptimized::StepVelocityRows(int rowBegin, int rowEnd, const WaterStepParams& params)
+{
+#if defined(ASTERWAVE_BOXSUM_TENSION)
+  StepVelocityRowsBoxSum(rowBegin, rowEnd, params);
+#else
+  StepVelocityRuns(rowBegin, rowEnd, params);
+#endif
+}
+
+// Hands the runs of working tiles in each row to VelocityRun
+void WaterSolverOptimized::StepVelocityRuns(int rowBegin, int rowEnd, const WaterStepParams& params)
+{
+  const int ydivs = m_field->YDivs();
+  for (int i = rowBegin; i < rowEnd; i++)
+  {
+    const unsigned char* work = &m_tileStep[(i/WATER_TILE_SIZE)*m_tilesY];
+    for (int tj = 0; tj < m_tilesY; tj++)
+    {
+      if (!work[tj])
+        continue;
+      // Neighbouring tiles are merged into one run for the kernel
+      const int jBegin = tj*WATER_TILE_SIZE;
+      while (tj+1 < m_tilesY && work[tj+1])
+        tj++;
+      const int jEnd = iMin(ydivs, (tj+1)*WATER_TILE_SIZE);
+      VelocityRun(i, jBegin, jEnd, params);
+    }
+  }
+}
+
+void WaterSolverOptimized::VelocityRun(int i, int jBegin, int jEnd, const WaterStepParams& params)
+{
+  const int xdivs = m_field->XDivs();
+  const int ydivs = m_field->YDivs();
+  const float* up = i > 0 ? m_field->HeightRow(i-1) : nullptr;
+  const float* row = m_field->HeightRow(i);
+  const float* down = i < xdivs-1 ? m_field->HeightRow(i+1) : nullptr;
+  float* velocity = m_field->VelocityRow(i);
+  auto clamped = [&](int begin, int end) {
+    WaterVelocityRowClamped(up, row, down, velocity, begin, end, ydivs, params);
+  };
+  if (!up || !down)
+  {
+    clamped(jBegin, jEnd);
+    return;
+  }
+  WaterSplitRow(jBegin, jEnd, ydivs, 1, clamped, [&](int begin, int end) {
+    m_velocityKernel(up, row, down, velocity, begin, end, params);
+  });
+}
+
+/************************************************************
+StepVelocityRowsBoxSum
+
+Same as StepVelocityRows but with the tension taken from
+separable box sums.  Within a row of tiles each run of working
+tiles keeps the horizontal sums of three rows and reuses two of
+them for the next row, so a cell costs about four additions
+instead of nine subtractions and additions.  The border rows
+and columns go through VelocityRun for their clamped stencil.
+************************************************************/
+void WaterSolverOptimized::StepVelocityRowsBoxSum(int rowBegin, int rowEnd, const WaterStepParams& params)
+{
+  const int stride = m_field->Stride();
+  const int xdivs = m_field->XDivs();
+  const int ydivs = m_field->YDivs();
+  std::vector<float> sums(3 * stride);
+
+  for (int ti = rowBegin / WATER_TILE_SIZE; ti * WATER_TILE_SIZE < rowEnd; ti++)
+  {
+    const unsigned char* work = &m_tileStep[ti*m_tilesY];
+    const int iBegin = ti*WATER_TILE_SIZE;
+    const int iEnd = iMin(rowEnd, iBegin + WATER_TILE_SIZE);
+    for (int tj = 0; tj < m_tilesY; tj++)
+    {
+      if (!work[tj])
+        continue;
+      const int jBegin = tj*WATER_TILE_SIZE;
+      while (tj+1 < m_tilesY && work[tj+1])
+        tj++;
+      const int jEnd = iMin(ydivs, (tj+1)*WATER_TILE_SIZE);
+
+      const int rowInnerBegin = iMax(iBegin, 1);
+      const int rowInnerEnd = iMin(iEnd, xdivs-1);
+      const int innerBegin = iMax(jBegin, 1);
+      const int innerEnd = iMin(jEnd, ydivs-1);
+      for (int i = iBegin; i < iEnd; i++)
+      {
+        if (i < rowInnerBegin || i >= rowInnerEnd || innerBegin >= innerEnd)
+        {
+          VelocityRun(i, jBegin, jEnd, params);
+          continue;
+        }
+        if (jBegin < innerBegin)
+          VelocityRun(i, jBegin, innerBegin, params);
+        if (innerEnd < jEnd)
+          VelocityRun(i, innerEnd, jEnd, params);
+      }
+      if (rowInnerBegin >= rowInnerEnd || innerBegin >= innerEnd)
+        continue;
+
+      float* sumUp = &sums[0];
+      float* sum = &sums[stride];
+      float* sumDown = &sums[2 * stride];
+      WaterRowSum3(m_field->HeightRow(rowInnerBegin-1), sumUp, innerBegin, innerEnd);
+      WaterRowSum3(m_field->HeightRow(rowInnerBegin), sum, innerBegin, innerEnd);
+      for (int i = rowInnerBegin; i < rowInnerEnd; i++)
+      {
+        WaterRowSum3(m_field->HeightRow(i+1), sumDown, innerBegin, innerEnd);
+        WaterVelocityRowBoxSum(sumUp, sum, sumDown, m_field->HeightRow(i), m_field->VelocityRow(i),
+                               innerBegin, innerEnd, params);
+        float* next = sumUp;
+        sumUp = sum;
+        sum = sumDown;
+        sumDown = next;
+      }
+    }
+  }
+}
+
+/************************************************************
+IntegrateAndNormalRows
+
+Moves the heights of a band of rows forward and computes the
+normals in the same sweep.  The normals trail the integration by
+the normal spread of two rows, so they always see the heights of
+this step while the rows are still in cache.  Normals of the
+rows at an inner band edge depend on the next band and are left
+for Step to finish once all bands are done.
+************************************************************/
+void WaterSolverOptimized::IntegrateAndNormalRows(int rowBegin, int rowEnd, float time)
+{
+  const int xdivs = m_field->XDivs();
+  const int s = m_field->NormalParams().spread;
+  const int normalBegin = rowBegin == 0 ? 0 : rowBegin + s;
+  const int normalEnd = rowEnd == xdivs ? xdivs : rowEnd - s;
+
+  for (int i = rowBegin; i < rowEnd; i++)
+  {
+    IntegrateHeightRow(i, time);
+    const int n = i - s;
+    if (n >= normalBegin && n < normalEnd)
+      NormalRow(n);
+  }
+  // The last rows of the field clamp their lower neighbours into it
+  for (int n = iMax(normalBegin, rowEnd - s); n < normalEnd; n++)
+    NormalRow(n);
+
+  for (int n = rowBegin; n < iMin(normalBegin, rowEnd); n++)
+    m_normalPending[n] = 1;
+  for (int n = iMax(normalEnd, rowBegin); n < rowEnd; n++)
+    m_normalPending[n] = 1;
+}
+
+void WaterSolverOptimized::IntegrateHeightRow(int i, float time)
+{
+  float* h = m_field->HeightRow(i);
+  float* prev = m_field->PrevHeightRow(i);
+  const float* v = m_field->VelocityRow(i);
+  const float rest = m_field->RestHeight();
+  const int ydivs = m_field->YDivs();
+  const int tileRow = (i/WATER_TILE_SIZE)*m_tilesY;
+  for (int tj = 0; tj < m_tilesY; tj++)
+  {
+    if (!m_tileStep[tileRow + tj])
+      continue;
+    float energy = m_tileEnergy[tileRow + tj];
+    const int jEnd = iMin(ydivs, (tj+1)*WATER_TILE_SIZE);
+    for (int j = tj*WATER_TILE_SIZE; j < jEnd; j++)
+    {
+      prev[j] = h[j];
+      h[j] += v[j]*time;
+      energy = fmaxf(energy, fmaxf(fabsf(h[j] - rest), fabsf(v[j])));
+    }
+    m_tileEnergy[tileRow + tj] = energy;
+  }
+}
+
+/************************************************************
+NormalRow
+
+Calculates the normals of row i in the water mesh by taking the
+normal to the plane that goes through three neighboring points
+spread two cells away.  This has the effect of smoothing out the
+lighting.  Near the border the points are clamped into the field.
+************************************************************/
+void WaterSolverOptimized::NormalRow(int i)
+{
+  const int ydivs = m_field->YDivs();
+  const unsigned char* work = &m_tileNormal[(i/WATER_TILE_SIZE)*m_tilesY];
+  for (int tj = 0; tj < m_tilesY; tj++)
+  {
+    if (!work[tj])
+      continue;
+    const int jBegin = tj*WATER_TILE_SIZE;
+    while (tj+1 < m_tilesY && work[tj+1])
+      tj++;
+    const int jEnd = iMin(ydivs, (tj+1)*WATER_TILE_SIZE);
+    m_field->UpdateNormals(m_normalKernel, i, jBegin, jEnd);
+  }
+}
+
+/************************************************************
+WaterSolverFixed::Init
+
+Moves the float heights and velocities of the field into two
+int16 planes, which use the same stride as the float planes.
+************************************************************/
+bool WaterSolverFixed::Init(WaterField& field)
+{
+  WaterSolverOptimized::Init(field);
+  m_fixedParams = WaterQuantizeParams(field.StepParams());
+  m_fixedVelocityKernel = GetWaterFixedVelocityRowKernel();
+  m_fixedIntegrateKernel = GetWaterFixedIntegrateRowKernel();
+  m_stride = field.Stride();
+
+  const int shortsPerAlign = WATER_ALIGN / sizeof(int16_t);
+  const size_t planeSize = field.PlaneSize();
+  m_fixedStorage.assign(2 * planeSize + shortsPerAlign, 0);
+  int16_t* base = m_fixedStorage.data();
+  base += (shortsPerAlign - ((uintptr_t)base / sizeof(int16_t)) % shortsPerAlign) % shortsPerAlign;
+  m_fixedHeight = base;
+  m_fixedVelocity = base + planeSize;
+
+  // Going through Stamp rounds the float heights to what the int16
+  // engine can represent
+  for (int i = 0; i < field.XDivs(); i++)
+    for (int j = 0; j < field.YDivs(); j++)
+    {
+      const float velocity = field.Velocity(i,j);
+      Stamp(i, j, 1.0f, field.Height(i,j));
+      FixedVelocityRow(i)[j] = (int16_t)fminf(fmaxf(ldexpf(velocity, WATER_FIXED_VELOCITY_BITS), -32768.0f), 32767.0f);
+      field.PrevHeight(i,j) = field.Height(i,j);
+    }
+  return true;
+}
+
+void WaterSolverFixed::Step(float time)
+{
+  m_stepTime = WaterQuantizeStepTime(time);
+  WaterSolverOptimized::Step(time);
+}
+
+void WaterSolverFixed::Stamp(int i, int j, float weight, float newHeight)
+{
+  MarkActive(i,j);
+  const float height = weight*newHeight + (1-weight)*m_field->Height(i,j);
+  const float scaled = fminf(fmaxf(ldexpf(height, WATER_FIXED_HEIGHT_BITS), -32768.0f), 32767.0f);
+  const int16_t fixedHeight = (int16_t)lrintf(scaled);
+  FixedHeightRow(i)[j] = fixedHeight;
+  FixedVelocityRow(i)[j] = (int16_t)lrintf((1-weight)*FixedVelocityRow(i)[j]);
+  m_field->Height(i,j) = ldexpf(fixedHeight, -WATER_FIXED_HEIGHT_BITS);
+}
+
+// The heights are written on every step, only the velocities live in
+// the int16 planes alone
+void WaterSolverFixed::ReadHeights()
+{
+  for (int i = 0; i < m_field->XDivs(); i++)
+    for (int j = 0; j < m_field->YDivs(); j++)
+      m_field->Velocity(i,j) = ldexpf(FixedVelocityRow(i)[j], -WATER_FIXED_VELOCITY_BITS);
+}
+
+// The box sums only exist in float
+void WaterSolverFixed::StepVelocityRows(int rowBegin, int rowEnd, const WaterStepParams& params)
+{
+  StepVelocityRuns(rowBegin, rowEnd, params);
+}
+
+void WaterSolverFixed::VelocityRun(int i, int jBegin, int jEnd, const WaterStepParams& /* params */)
+{
+  const int xdivs = m_field->XDivs();
+  const int ydivs = m_field->YDivs();
+  const int16_t* up = i > 0 ? FixedHeightRow(i-1) : nullptr;
+  const int16_t* row = FixedHeightRow(i);
+  const int16_t* down = i < xdivs-1 ? FixedHeightRow(i+1) : nullptr;
+  int16_t* velocity = FixedVelocityRow(i);
+  auto clamped = [&](int begin, int end) {
+    WaterFixedVelocityRowClamped(up, row, down, velocity, begin, end, ydivs, m_fixedParams);
+  };
+  if (!up || !down)
+  {
+    clamped(jBegin, jEnd);
+    return;
+  }
+  WaterSplitRow(jBegin, jEnd, ydivs, 1, clamped, [&](int begin, int end) {
+    m_fixedVelocityKernel(up, row, down, velocity, begin, end, m_fixedParams);
+  });
+}
+
+void WaterSolverFixed::IntegrateHeightRow(int i, float /* time */)
+{
+  int16_t* h = FixedHeightRow(i);
+  const int16_t* v = FixedVelocityRow(i);
+  float* height = m_field->HeightRow(i);
+  float* prev = m_field->PrevHeightRow(i);
+  const float rest = m_field->RestHeight();
+  const float velocityScale = 1.0f / (1 << WATER_FIXED_VELOCITY_BITS);
+  const int ydivs = m_field->YDivs();
+  const int tileRow = (i/WATER_TILE_SIZE)*m_tilesY;
+  for (int tj = 0; tj < m_tilesY; tj++)
+  {
+    if (!m_tileStep[tileRow + tj])
+      continue;
+    const int jBegin = tj*WATER_TILE_SIZE;
+    const int jEnd = iMin(ydivs, (tj+1)*WATER_TILE_SIZE);
+    m_fixedIntegrateKernel(h, v, height, prev, jBegin, jEnd, m_stepTime);
+
+    float energy = m_tileEnergy[tileRow + tj];
+    for (int j = jBegin; j < jEnd; j++)
+      energy = fmaxf(energy, fmaxf(fabsf(height[j] - rest), fabsf(v[j]*velocityScale)));
+    m_tileEnergy[tileRow + tj] = energy;
+  }
+}
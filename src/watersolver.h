@@ -0,0 +1,174 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *  Copyright (C) 2007 Asteron (http://asteron.projects.googlepages.com/home)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include "ThreadPool.h"
+#include "waterkernels.h"
+
+#include <memory>
+#include <vector>
+
+// The field is split into square tiles of cells which are only
+// simulated while something moves in or next to them.
+#define WATER_TILE_SIZE 16
+#define ACTIVE_TILE_THRESHOLD 0.001f
+// The fixed point engine stalls a few steps of its resolution away
+// from rest, small heights no longer produce a velocity step
+#define FIXED_ACTIVE_TILE_THRESHOLD 0.008f
+
+// Values of the solver setting
+#define WATER_SOLVER_OPTIMIZED 0
+#define WATER_SOLVER_FIXED 1
+#define WATER_SOLVER_REFERENCE 2
+#define WATER_SOLVER_GPU 3
+
+// The GPU solver renders into float textures, which GLES only has
+// from version 3 on
+#if !defined(HAS_GLES) || HAS_GLES >= 3
+#define WATER_HAS_GPU_SOLVER
+#endif
+
+class WaterField;
+
+// Moves the water of a WaterField forward in time. The field owns the
+// float height, previous height, velocity and normal planes the
+// renderer reads, a solver may keep its own state next to them as
+// long as Step leaves those planes up to date.
+class IWaterSolver
+{
+public:
+  virtual ~IWaterSolver() = default;
+  virtual const char* Name() const = 0;
+
+  // Binds the solver to field and takes over the heights and
+  // velocities found in its planes. Returns false if the solver can not
+  // run on this system.
+  virtual bool Init(WaterField& field) = 0;
+  // Advances the water by time seconds and leaves the new heights, the
+  // heights before the step and the normals in the field's planes
+  virtual void Step(float time) = 0;
+  // Pulls cell (i,j) towards newHeight by weight and slows it down as much
+  virtual void Stamp(int i, int j, float weight, float newHeight) = 0;
+  // Writes the solver's own state back into the field's height and
+  // velocity planes, done before another solver takes over
+  virtual void ReadHeights() = 0;
+  // Tiles worked on by the last Step
+  virtual int ActiveTiles() const = 0;
+  // True if Step has to be called on the thread owning the GL context
+  virtual bool UsesGL() const { return false; }
+  // Texture holding the heights after the last step in red and before
+  // it in blue, 0 if the heights only live in the field's planes
+  virtual unsigned int HeightTexture() const { return 0; }
+  // Whether the renderer reads the field's planes after every step. One
+  // sampling HeightTexture() turns this off, the planes then only get
+  // the state back in ReadHeights.
+  virtual void SetPlanesRead(bool /* read */) {}
+};
+
+// Returns the solver registered for type, unknown types fall back to
+// the optimized solver
+std::unique_ptr<IWaterSolver> CreateWaterSolver(int type);
+
+// Plain solver working on every cell at every step, in scalar code on
+// one thread, with the clamped stencils of the original
+// WaterField::Step at every cell. It defines what the other solvers
+// are compared against.
+class WaterSolverReference : public IWaterSolver
+{
+public:
+  const char* Name() const override { return "reference"; }
+  bool Init(WaterField& field) override;
+  void Step(float time) override;
+  void Stamp(int i, int j, float weight, float newHeight) override;
+  void ReadHeights() override {}
+  int ActiveTiles() const override;
+
+private:
+  WaterField* m_field = nullptr;
+};
+
+// Vectorized kernels split into row bands over the field's thread pool,
+// only simulating the tiles where something moves.
+class WaterSolverOptimized : public IWaterSolver
+{
+public:
+  WaterSolverOptimized() = default;
+  const char* Name() const override { return "optimized"; }
+  bool Init(WaterField& field) override;
+  void Step(float time) override;
+  void Stamp(int i, int j, float weight, float newHeight) override;
+  void ReadHeights() override {}
+  int ActiveTiles() const override { return m_activeTiles; }
+
+protected:
+  explicit WaterSolverOptimized(float restThreshold) : m_restThreshold(restThreshold) {}
+
+  // Velocity update of the cells [jBegin, jEnd) of row i. The kernel
+  // gets the cells away from the border, the border cells keep the
+  // clamped stencil of the reference solver.
+  virtual void VelocityRun(int i, int jBegin, int jEnd, const WaterStepParams& params);
+  virtual void StepVelocityRows(int rowBegin, int rowEnd, const WaterStepParams& params);
+  virtual void IntegrateHeightRow(int i, float time);
+
+  void UpdateWorkTiles();
+  void UpdateActiveTiles();
+  void MarkActive(int i, int j);
+  void RunRows(const CThreadPool::BandTask& task);
+  void StepVelocityRuns(int rowBegin, int rowEnd, const WaterStepParams& params);
+  void StepVelocityRowsBoxSum(int rowBegin, int rowEnd, const WaterStepParams& params);
+  void IntegrateAndNormalRows(int rowBegin, int rowEnd, float time);
+  void NormalRow(int i);
+
+  WaterField* m_field = nullptr;
+  float m_restThreshold = ACTIVE_TILE_THRESHOLD;
+  WaterVelocityRowFunc m_velocityKernel = nullptr;
+  WaterNormalRowFunc m_normalKernel = nullptr;
+
+  int m_tilesX = 0;
+  int m_tilesY = 0;
+  int m_activeTiles = 0;
+  std::vector<unsigned char> m_tileActive;
+  std::vector<unsigned char> m_tileStep;
+  std::vector<unsigned char> m_tileNormal;
+  std::vector<float> m_tileEnergy;
+  std::vector<unsigned char> m_normalPending;
+};
+
+// The int16 engine of waterkernels.h. The float heights are still
+// written every step for the normals and the rendering, so the int16
+// planes come on top of the float planes of the field. What it saves
+// is float arithmetic in the step, not memory.
+class WaterSolverFixed : public WaterSolverOptimized
+{
+public:
+  WaterSolverFixed() : WaterSolverOptimized(FIXED_ACTIVE_TILE_THRESHOLD) {}
+  const char* Name() const override { return "fixed point"; }
+  bool Init(WaterField& field) override;
+  void Step(float time) override;
+  void Stamp(int i, int j, float weight, float newHeight) override;
+  void ReadHeights() override;
+
+protected:
+  void VelocityRun(int i, int jBegin, int jEnd, const WaterStepParams& /* params */) override;
+  void StepVelocityRows(int rowBegin, int rowEnd, const WaterStepParams& params) override;
+  void IntegrateHeightRow(int i, float time) override;
+
+private:
+  int16_t* FixedHeightRow(int i) { return m_fixedHeight + i*m_stride; }
+  int16_t* FixedVelocityRow(int i) { return m_fixedVelocity + i*m_stride; }
+
+  WaterFixedParams m_fixedParams;
+  WaterFixedVelocityRowFunc m_fixedVelocityKernel = nullptr;
+  WaterFixedIntegrateRowFunc m_fixedIntegrateKernel = nullptr;
+  int16_t m_stepTime = 0;
+  int m_stride = 0;
+  std::vector<int16_t> m_fixedStorage;
+  int16_t* m_fixedHeight = nullptr;
+  int16_t* m_fixedVelocity = nullptr;
+};
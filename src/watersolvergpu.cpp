@@ -0,0 +1,503 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *  Copyright (C) 2007 Asteron (http://asteron.projects.googlepages.com/home)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+//////////////////////////////////////////////////////////////////
+// WATERSOLVERGPU.CPP
+//
+// Solver running the velocity and height update of the water in a
+// fragment shader, see simfrag.glsl for the step itself and
+// normalfrag.glsl for the normals.
+//
+//////////////////////////////////////////////////////////////////
+
+#include "watersolvergpu.h"
+
+#if defined(WATER_HAS_GPU_SOLVER)
+
+#include "waterfield.h"
+
+#include <kodi/AddonBase.h>
+
+#include <cstddef>
+#include <cstring>
+#include <math.h>
+
+// The state texture has one texel per cell, row i of the field is row
+// i of the texture. The channels hold height, velocity and previous
+// height. GL 3 renders and blends into any float format. GLES 3 does
+// neither for floats on its own, EXT_color_buffer_half_float or
+// EXT_color_buffer_float add both for half floats only.
+#if defined(HAS_GLES)
+#define WATER_STATE_FORMAT GL_RGBA16F
+#else
+#define WATER_STATE_FORMAT GL_RGBA32F
+#endif
+
+// Nanoseconds for one wait on a readback fence
+#define WATER_GPU_WAIT_TIME 1000000
+
+#if defined(HAS_GLES)
+static bool HasExtension(const char* name)
+{
+  GLint extensions = 0;
+  glGetIntegerv(GL_NUM_EXTENSIONS, &extensions);
+  for (GLint i = 0; i < extensions; i++)
+  {
+    const GLubyte* extension = glGetStringi(GL_EXTENSIONS, i);
+    if (extension && strcmp(reinterpret_cast<const char*>(extension), name) == 0)
+      return true;
+  }
+  return false;
+}
+#endif
+
+static void RunRows(WaterField& field, const CThreadPool::BandTask& task)
+{
+  if (field.ThreadPool())
+    field.ThreadPool()->Run(field.XDivs(), 8, task);
+  else
+    task(0, field.XDivs());
+}
+
+WaterSolverGpu::~WaterSolverGpu()
+{
+  for (Readback& readback : m_readbacks)
+  {
+    if (readback.fence)
+      glDeleteSync(readback.fence);
+    if (readback.buffer != 0)
+      glDeleteBuffers(1, &readback.buffer);
+  }
+  if (m_state[0] != 0)
+    glDeleteTextures(2, m_state);
+  if (m_surface != 0)
+    glDeleteTextures(1, &m_surface);
+  if (m_framebuffer != 0)
+    glDeleteFramebuffers(1, &m_framebuffer);
+  if (m_quadVBO != 0)
+    glDeleteBuffers(1, &m_quadVBO);
+  if (m_splatVBO != 0)
+    glDeleteBuffers(1, &m_splatVBO);
+}
+
+bool WaterSolverGpu::LoadShader(kodi::gui::gl::CShaderProgram& shader, const char* vert, const char* frag)
+{
+  const std::string path = "resources/shaders/" GL_TYPE_STRING "/";
+  if (!shader.LoadShaderFiles(kodi::addon::GetAddonPath(path + vert), kodi::addon::GetAddonPath(path + frag)) ||
+      !shader.CompileAndLink())
+  {
+    kodi::Log(ADDON_LOG_ERROR, "Failed to create and compile water simulation shader %s", frag);
+    return false;
+  }
+  return true;
+}
+
+/************************************************************
+Init
+
+Creates the two state textures and uploads the field into one
+of them, next to the surface texture and its pixel buffers.
+Fails without float render targets that can be blended into,
+which leaves it to the field to fall back to a CPU solver.
+************************************************************/
+bool WaterSolverGpu::Init(WaterField& field)
+{
+  m_field = &field;
+  m_current = 0;
+  m_readbackNext = 0;
+  m_splats.clear();
+
+#if defined(HAS_GLES)
+  if (!HasExtension("GL_EXT_color_buffer_half_float") && !HasExtension("GL_EXT_color_buffer_float"))
+  {
+    kodi::Log(ADDON_LOG_ERROR, "Half float render targets are not supported");
+    return false;
+  }
+#endif
+
+  if (!LoadShader(m_stepShader, "simvert.glsl", "simfrag.glsl") ||
+      !LoadShader(m_splatShader, "splatvert.glsl", "splatfrag.glsl") ||
+      !LoadShader(m_normalShader, "simvert.glsl", "normalfrag.glsl"))
+    return false;
+
+  m_stepPositionLoc = glGetAttribLocation(m_stepShader.ProgramHandle(), "a_position");
+  m_stepStateLoc = glGetUniformLocation(m_stepShader.ProgramHandle(), "u_state");
+  m_stepTexelLoc = glGetUniformLocation(m_stepShader.ProgramHandle(), "u_texel");
+  m_stepRestHeightLoc = glGetUniformLocation(m_stepShader.ProgramHandle(), "u_restHeight");
+  m_stepElasticityLoc = glGetUniformLocation(m_stepShader.ProgramHandle(), "u_elasticity");
+  m_stepViscosityLoc = glGetUniformLocation(m_stepShader.ProgramHandle(), "u_viscosity");
+  m_stepTensionLoc = glGetUniformLocation(m_stepShader.ProgramHandle(), "u_tension");
+  m_stepTimeLoc = glGetUniformLocation(m_stepShader.ProgramHandle(), "u_time");
+  m_splatCellLoc = glGetAttribLocation(m_splatShader.ProgramHandle(), "a_cell");
+  m_splatValueLoc = glGetAttribLocation(m_splatShader.ProgramHandle(), "a_splat");
+  m_splatTexelLoc = glGetUniformLocation(m_splatShader.ProgramHandle(), "u_texel");
+  m_normalPositionLoc = glGetAttribLocation(m_normalShader.ProgramHandle(), "a_position");
+  m_normalStateLoc = glGetUniformLocation(m_normalShader.ProgramHandle(), "u_state");
+  m_normalGridSizeLoc = glGetUniformLocation(m_normalShader.ProgramHandle(), "u_gridSize");
+  m_normalDivDistLoc = glGetUniformLocation(m_normalShader.ProgramHandle(), "u_divDist");
+  m_normalSpreadLoc = glGetUniformLocation(m_normalShader.ProgramHandle(), "u_spread");
+
+  const int xdivs = field.XDivs();
+  const int ydivs = field.YDivs();
+  m_transfer.resize((size_t)xdivs * ydivs * 4);
+  for (int i = 0; i < xdivs; i++)
+  {
+    float* texel = &m_transfer[(size_t)i * ydivs * 4];
+    for (int j = 0; j < ydivs; j++, texel += 4)
+    {
+      texel[0] = field.Height(i,j);
+      texel[1] = field.Velocity(i,j);
+      texel[2] = field.PrevHeight(i,j);
+      texel[3] = 0.0f;
+    }
+  }
+
+  SavedState saved;
+  SaveState(saved);
+
+  glGenTextures(2, m_state);
+  for (GLuint texture : m_state)
+  {
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexImage2D(GL_TEXTURE_2D, 0, WATER_STATE_FORMAT, ydivs, xdivs, 0, GL_RGBA, GL_FLOAT, m_transfer.data());
+  }
+
+  // Height, previous height and the x and y of the normal of every cell
+  glGenTextures(1, &m_surface);
+  glBindTexture(GL_TEXTURE_2D, m_surface);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, WATER_STATE_FORMAT, ydivs, xdivs, 0, GL_RGBA, GL_FLOAT, nullptr);
+  for (Readback& readback : m_readbacks)
+  {
+    glGenBuffers(1, &readback.buffer);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+    glBufferData(GL_PIXEL_PACK_BUFFER, m_transfer.size() * sizeof(float), nullptr, GL_STREAM_READ);
+  }
+
+  glGenFramebuffers(1, &m_framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_state[0], 0);
+  const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+
+  const float quad[] = { -1.0f, -1.0f, 1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f };
+  glGenBuffers(1, &m_quadVBO);
+  glBindBuffer(GL_ARRAY_BUFFER, m_quadVBO);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+  glGenBuffers(1, &m_splatVBO);
+
+  RestoreState(saved);
+
+  if (status != GL_FRAMEBUFFER_COMPLETE)
+  {
+    kodi::Log(ADDON_LOG_ERROR, "Float render targets are not supported (status 0x%x)", status);
+    return false;
+  }
+  return true;
+}
+
+/************************************************************
+Step
+
+The stamps queued since the last step are drawn into the
+current state first, then one pass computes the next state
+into the other texture and another one the surface from it.
+The surface is queued for reading back, and whatever earlier
+readbacks the GPU is done with land in the field's planes.
+************************************************************/
+void WaterSolverGpu::Step(float time)
+{
+  SavedState saved;
+  SaveState(saved);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+  glViewport(0, 0, m_field->YDivs(), m_field->XDivs());
+  glDisable(GL_SCISSOR_TEST);
+  glDisable(GL_CULL_FACE);
+  glDisable(GL_DEPTH_TEST);
+#ifndef HAS_GLES
+  // SetupRenderState picks the polygon mode of the water again
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+#endif
+  glActiveTexture(GL_TEXTURE0);
+
+  DrawSplats();
+  DrawStep(time);
+  if (m_planesRead)
+  {
+    DrawNormals();
+    QueueReadBack();
+    CollectReadBacks();
+  }
+
+  RestoreState(saved);
+}
+
+void WaterSolverGpu::Stamp(int i, int j, float weight, float newHeight)
+{
+  // Done on the CPU copy as well so that GetHeight sees the stamp
+  // before the next step
+  m_field->Height(i,j) = weight*newHeight + (1-weight)*m_field->Height(i,j);
+  m_field->Velocity(i,j) = (1-weight)*m_field->Velocity(i,j);
+  m_splats.push_back({(float)j, (float)i, weight, newHeight});
+}
+
+int WaterSolverGpu::ActiveTiles() const
+{
+  return m_field->TileCount();
+}
+
+void WaterSolverGpu::SaveState(SavedState& state)
+{
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &state.drawFramebuffer);
+  glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &state.readFramebuffer);
+  glGetIntegerv(GL_VIEWPORT, state.viewport);
+  glGetIntegerv(GL_CURRENT_PROGRAM, &state.program);
+  glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &state.arrayBuffer);
+  glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &state.pixelPackBuffer);
+  glGetIntegerv(GL_ACTIVE_TEXTURE, &state.activeTexture);
+  glActiveTexture(GL_TEXTURE0);
+  glGetIntegerv(GL_TEXTURE_BINDING_2D, &state.texture);
+  glGetIntegerv(GL_BLEND_SRC_RGB, &state.blendSrcRGB);
+  glGetIntegerv(GL_BLEND_DST_RGB, &state.blendDstRGB);
+  glGetIntegerv(GL_BLEND_SRC_ALPHA, &state.blendSrcAlpha);
+  glGetIntegerv(GL_BLEND_DST_ALPHA, &state.blendDstAlpha);
+  glGetBooleanv(GL_COLOR_WRITEMASK, state.colorMask);
+  state.blend = glIsEnabled(GL_BLEND);
+  state.scissorTest = glIsEnabled(GL_SCISSOR_TEST);
+  state.cullFace = glIsEnabled(GL_CULL_FACE);
+  state.depthTest = glIsEnabled(GL_DEPTH_TEST);
+}
+
+static void SetEnabled(GLenum cap, GLboolean enabled)
+{
+  if (enabled)
+    glEnable(cap);
+  else
+    glDisable(cap);
+}
+
+void WaterSolverGpu::RestoreState(const SavedState& state)
+{
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, state.drawFramebuffer);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, state.readFramebuffer);
+  glViewport(state.viewport[0], state.viewport[1], state.viewport[2], state.viewport[3]);
+  glUseProgram(state.program);
+  glBindBuffer(GL_ARRAY_BUFFER, state.arrayBuffer);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, state.pixelPackBuffer);
+  glBindTexture(GL_TEXTURE_2D, state.texture);
+  glActiveTexture(state.activeTexture);
+  glBlendFuncSeparate(state.blendSrcRGB, state.blendDstRGB, state.blendSrcAlpha, state.blendDstAlpha);
+  glColorMask(state.colorMask[0], state.colorMask[1], state.colorMask[2], state.colorMask[3]);
+  SetEnabled(GL_BLEND, state.blend);
+  SetEnabled(GL_SCISSOR_TEST, state.scissorTest);
+  SetEnabled(GL_CULL_FACE, state.cullFace);
+  SetEnabled(GL_DEPTH_TEST, state.depthTest);
+}
+
+void WaterSolverGpu::DrawSplats()
+{
+  if (m_splats.empty())
+    return;
+
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_state[m_current], 0);
+  glBindBuffer(GL_ARRAY_BUFFER, m_splatVBO);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(Splat)*m_splats.size(), m_splats.data(), GL_STREAM_DRAW);
+
+  m_splatShader.EnableShader();
+  glUniform2f(m_splatTexelLoc, 1.0f / m_field->YDivs(), 1.0f / m_field->XDivs());
+  glVertexAttribPointer(m_splatCellLoc, 2, GL_FLOAT, GL_FALSE, sizeof(Splat), BUFFER_OFFSET(offsetof(Splat, j)));
+  glEnableVertexAttribArray(m_splatCellLoc);
+  glVertexAttribPointer(m_splatValueLoc, 2, GL_FLOAT, GL_FALSE, sizeof(Splat), BUFFER_OFFSET(offsetof(Splat, weight)));
+  glEnableVertexAttribArray(m_splatValueLoc);
+
+  // The splats output (height, 0) with the weight as alpha, blending
+  // them does what WaterSolverReference::Stamp does in order of the
+  // stamps. The previous height is left alone.
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glColorMask(GL_TRUE, GL_TRUE, GL_FALSE, GL_FALSE);
+  glDrawArrays(GL_POINTS, 0, m_splats.size());
+  glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+  glDisable(GL_BLEND);
+
+  glDisableVertexAttribArray(m_splatCellLoc);
+  glDisableVertexAttribArray(m_splatValueLoc);
+  m_splatShader.DisableShader();
+  m_splats.clear();
+}
+
+void WaterSolverGpu::DrawStep(float time)
+{
+  const WaterStepParams params = m_field->StepParams();
+  const GLuint source = m_state[m_current];
+  m_current = 1 - m_current;
+
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_state[m_current], 0);
+  glBindTexture(GL_TEXTURE_2D, source);
+  glBindBuffer(GL_ARRAY_BUFFER, m_quadVBO);
+
+  m_stepShader.EnableShader();
+  glUniform1i(m_stepStateLoc, 0);
+  glUniform2f(m_stepTexelLoc, 1.0f / m_field->YDivs(), 1.0f / m_field->XDivs());
+  glUniform1f(m_stepRestHeightLoc, params.restHeight);
+  glUniform1f(m_stepElasticityLoc, params.elasticity);
+  glUniform1f(m_stepViscosityLoc, params.viscosity);
+  glUniform1f(m_stepTensionLoc, params.tension);
+  glUniform1f(m_stepTimeLoc, time);
+  glVertexAttribPointer(m_stepPositionLoc, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+  glEnableVertexAttribArray(m_stepPositionLoc);
+
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+  glDisableVertexAttribArray(m_stepPositionLoc);
+  m_stepShader.DisableShader();
+}
+
+void WaterSolverGpu::DrawNormals()
+{
+  const WaterNormalParams& params = m_field->NormalParams();
+
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_surface, 0);
+  glBindTexture(GL_TEXTURE_2D, m_state[m_current]);
+  glBindBuffer(GL_ARRAY_BUFFER, m_quadVBO);
+
+  m_normalShader.EnableShader();
+  glUniform1i(m_normalStateLoc, 0);
+  glUniform2f(m_normalGridSizeLoc, (float)m_field->XDivs(), (float)m_field->YDivs());
+  glUniform2f(m_normalDivDistLoc, params.xdivdist, params.ydivdist);
+  glUniform1f(m_normalSpreadLoc, (float)params.spread);
+  glVertexAttribPointer(m_normalPositionLoc, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+  glEnableVertexAttribArray(m_normalPositionLoc);
+
+  glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+
+  glDisableVertexAttribArray(m_normalPositionLoc);
+  m_normalShader.DisableShader();
+}
+
+// Starts reading the surface into the next pixel buffer. Only if the
+// GPU is still on the step that buffer was used for, which takes it
+// WATER_GPU_READBACKS steps behind, does this wait for it.
+void WaterSolverGpu::QueueReadBack()
+{
+  Readback& readback = m_readbacks[m_readbackNext];
+  if (readback.fence)
+    CopySurface(readback);
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+  glReadPixels(0, 0, m_field->YDivs(), m_field->XDivs(), GL_RGBA, GL_FLOAT, BUFFER_OFFSET(0));
+  readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  m_readbackNext = (m_readbackNext + 1) % WATER_GPU_READBACKS;
+}
+
+// Copies the readbacks the GPU is done with, oldest first
+void WaterSolverGpu::CollectReadBacks()
+{
+  for (int n = 0; n < WATER_GPU_READBACKS; n++)
+  {
+    Readback& readback = m_readbacks[(m_readbackNext + n) % WATER_GPU_READBACKS];
+    if (!readback.fence)
+      continue;
+    const GLenum status = glClientWaitSync(readback.fence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+      return;
+    CopySurface(readback);
+  }
+}
+
+// Waits for the fence of readback and copies its surface into the
+// field's planes
+void WaterSolverGpu::CopySurface(Readback& readback)
+{
+  while (glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, WATER_GPU_WAIT_TIME) == GL_TIMEOUT_EXPIRED)
+  {
+  }
+  glDeleteSync(readback.fence);
+  readback.fence = nullptr;
+
+  WaterField& field = *m_field;
+  const int ydivs = field.YDivs();
+  const size_t size = (size_t)field.XDivs() * ydivs * 4 * sizeof(float);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+  const float* surface = static_cast<const float*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, GL_MAP_READ_BIT));
+  if (!surface)
+    return;
+
+  RunRows(field, [&](int begin, int end) {
+    for (int i = begin; i < end; i++)
+    {
+      const float* texel = surface + (size_t)i * ydivs * 4;
+      float* height = field.HeightRow(i);
+      float* prevHeight = field.PrevHeightRow(i);
+      float* normalX = field.NormalXRow(i);
+      float* normalY = field.NormalYRow(i);
+      float* normalZ = field.NormalZRow(i);
+      for (int j = 0; j < ydivs; j++, texel += 4)
+      {
+        height[j] = texel[0];
+        prevHeight[j] = texel[1];
+        normalX[j] = texel[2];
+        normalY[j] = texel[3];
+        normalZ[j] = sqrtf(fmaxf(1.0f - texel[2]*texel[2] - texel[3]*texel[3], 0.0f));
+      }
+    }
+  });
+  glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+}
+
+/************************************************************
+ReadHeights
+
+Finishes the readbacks still in flight and reads the whole
+state back, velocities included.  This one waits for the GPU,
+it is only done when another solver or field takes over.
+************************************************************/
+void WaterSolverGpu::ReadHeights()
+{
+  SavedState saved;
+  SaveState(saved);
+
+  for (int n = 0; n < WATER_GPU_READBACKS; n++)
+  {
+    Readback& readback = m_readbacks[(m_readbackNext + n) % WATER_GPU_READBACKS];
+    if (readback.fence)
+      CopySurface(readback);
+  }
+
+  WaterField& field = *m_field;
+  const int ydivs = field.YDivs();
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  glBindFramebuffer(GL_FRAMEBUFFER, m_framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, m_state[m_current], 0);
+  glReadPixels(0, 0, ydivs, field.XDivs(), GL_RGBA, GL_FLOAT, m_transfer.data());
+
+  RunRows(field, [&](int begin, int end) {
+    for (int i = begin; i < end; i++)
+    {
+      const float* texel = &m_transfer[(size_t)i * ydivs * 4];
+      float* height = field.HeightRow(i);
+      float* velocity = field.VelocityRow(i);
+      float* prevHeight = field.PrevHeightRow(i);
+      for (int j = 0; j < ydivs; j++, texel += 4)
+      {
+        height[j] = texel[0];
+        velocity[j] = texel[1];
+        prevHeight[j] = texel[2];
+      }
+    }
+  });
+
+  RestoreState(saved);
+}
+
+#endif
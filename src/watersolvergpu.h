@@ -0,0 +1,135 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *  Copyright (C) 2007 Asteron (http://asteron.projects.googlepages.com/home)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+#include "watersolver.h"
+
+#if defined(WATER_HAS_GPU_SOLVER)
+
+#include <kodi/gui/gl/GL.h>
+#include <kodi/gui/gl/Shader.h>
+
+#include <vector>
+
+// Readbacks that may be in flight at once, a step can still be on its
+// way while the one before it is copied into the field
+#define WATER_GPU_READBACKS 2
+
+// Runs the steps as fragment shader passes over a float texture holding
+// the height, velocity and previous height of every cell, ping-ponging
+// between two of them. The stamps of the effects are queued and drawn
+// as blended points into the state before the next step. Another pass
+// computes the normals into a surface texture, which is read back into
+// the field's planes through pixel buffers without waiting for the
+// GPU. The planes pick a step up once its fence has signalled, usually
+// one step later. The velocities stay on the GPU until ReadHeights.
+// A renderer sampling the state texture directly can switch the
+// normals and the readback off with SetPlanesRead(false).
+//
+// All calls have to be made with the GL context current.
+class WaterSolverGpu : public IWaterSolver
+{
+public:
+  WaterSolverGpu() = default;
+  ~WaterSolverGpu() override;
+  const char* Name() const override { return "GPU"; }
+  bool Init(WaterField& field) override;
+  void Step(float time) override;
+  void Stamp(int i, int j, float weight, float newHeight) override;
+  void ReadHeights() override;
+  int ActiveTiles() const override;
+  bool UsesGL() const override { return true; }
+  unsigned int HeightTexture() const override { return m_state[m_current]; }
+  void SetPlanesRead(bool read) override { m_planesRead = read; }
+
+private:
+  // Pixel buffer a surface is read into, and the fence after the read
+  struct Readback
+  {
+    GLuint buffer;
+    GLsync fence;
+  };
+
+  // Vertex of the point drawn for one stamp
+  struct Splat
+  {
+    float j, i;
+    float weight;
+    float height;
+  };
+
+  // GL state changed by the passes, put back for the renderer
+  struct SavedState
+  {
+    GLint drawFramebuffer;
+    GLint readFramebuffer;
+    GLint viewport[4];
+    GLint program;
+    GLint arrayBuffer;
+    GLint pixelPackBuffer;
+    GLint activeTexture;
+    GLint texture;
+    GLint blendSrcRGB;
+    GLint blendDstRGB;
+    GLint blendSrcAlpha;
+    GLint blendDstAlpha;
+    GLboolean colorMask[4];
+    GLboolean blend;
+    GLboolean scissorTest;
+    GLboolean cullFace;
+    GLboolean depthTest;
+  };
+
+  bool LoadShader(kodi::gui::gl::CShaderProgram& shader, const char* vert, const char* frag);
+  void SaveState(SavedState& state);
+  void RestoreState(const SavedState& state);
+  void DrawSplats();
+  void DrawStep(float time);
+  void DrawNormals();
+  void QueueReadBack();
+  void CollectReadBacks();
+  void CopySurface(Readback& readback);
+
+  WaterField* m_field = nullptr;
+  kodi::gui::gl::CShaderProgram m_stepShader;
+  kodi::gui::gl::CShaderProgram m_splatShader;
+  kodi::gui::gl::CShaderProgram m_normalShader;
+  GLuint m_state[2] = {0, 0};
+  GLuint m_surface = 0;
+  int m_current = 0;
+  bool m_planesRead = true;
+  GLuint m_framebuffer = 0;
+  GLuint m_quadVBO = 0;
+  GLuint m_splatVBO = 0;
+
+  GLint m_stepPositionLoc = -1;
+  GLint m_stepStateLoc = -1;
+  GLint m_stepTexelLoc = -1;
+  GLint m_stepRestHeightLoc = -1;
+  GLint m_stepElasticityLoc = -1;
+  GLint m_stepViscosityLoc = -1;
+  GLint m_stepTensionLoc = -1;
+  GLint m_stepTimeLoc = -1;
+  GLint m_splatCellLoc = -1;
+  GLint m_splatValueLoc = -1;
+  GLint m_splatTexelLoc = -1;
+  GLint m_normalPositionLoc = -1;
+  GLint m_normalStateLoc = -1;
+  GLint m_normalGridSizeLoc = -1;
+  GLint m_normalDivDistLoc = -1;
+  GLint m_normalSpreadLoc = -1;
+
+  std::vector<Splat> m_splats;
+  std::vector<float> m_transfer;
+  Readback m_readbacks[WATER_GPU_READBACKS] = {};
+  // Slot of the next readback, the oldest one still in flight
+  int m_readbackNext = 0;
+};
+
+#endif
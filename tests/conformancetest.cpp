@@ -0,0 +1,68 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+// Steps every solver backend alongside the reference solver from the
+// same splashes and checks that the heights stay within the tolerance
+// of the backend. The GPU solver needs a GL context and is skipped.
+
+#include "watertest.h"
+
+#include <stdio.h>
+
+#define TEST_STEPS 1000
+
+struct Backend
+{
+  const char* name;
+  int solver;
+  unsigned int threads;
+  // Largest height difference to the reference solver
+  float tolerance;
+};
+
+// The optimized solver sums the tension in the same order as the
+// reference, it only differs where it settles tiles that came to rest
+static const Backend backends[] = {
+  {"optimized", WATER_SOLVER_OPTIMIZED, 0, ACTIVE_TILE_THRESHOLD},
+  {"optimized, threaded", WATER_SOLVER_OPTIMIZED, 4, ACTIVE_TILE_THRESHOLD},
+  {"fixed point", WATER_SOLVER_FIXED, 0, WATER_FIXED_MAX_ERROR},
+};
+
+int main()
+{
+  int failed = 0;
+  for (const Backend& backend : backends)
+  {
+    std::unique_ptr<WaterField> reference = CreateTestField(WATER_SOLVER_REFERENCE);
+    std::unique_ptr<WaterField> field = CreateTestField(backend.solver);
+    CThreadPool pool;
+    if (backend.threads)
+    {
+      pool.Start(backend.threads);
+      field->SetThreadPool(&pool);
+    }
+
+    float worst = 0.0f;
+    for (int step = 0; step < TEST_STEPS; step++)
+    {
+      TestSplash(*reference, step);
+      TestSplash(*field, step);
+      reference->Step(TEST_STEP_TIME);
+      field->Step(TEST_STEP_TIME);
+      worst = fmaxf(worst, MaxHeightDifference(*reference, *field));
+    }
+    pool.Stop();
+
+    const bool passed = worst <= backend.tolerance;
+    printf("%s: largest height difference %f, tolerance %f, %s\n",
+           backend.name, worst, backend.tolerance, passed ? "passed" : "FAILED");
+    if (!passed)
+      failed++;
+  }
+  printf("gpu: skipped, needs a GL context\n");
+  return failed ? 1 : 0;
+}
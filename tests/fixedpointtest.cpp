@@ -0,0 +1,36 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+// Steps the fixed point engine and the float engine from the same
+// splashes and checks that the heights stay within
+// WATER_FIXED_MAX_ERROR of each other.
+
+#include "watertest.h"
+
+#include <stdio.h>
+
+#define TEST_STEPS 3000
+
+int main()
+{
+  std::unique_ptr<WaterField> floatField = CreateTestField(WATER_SOLVER_REFERENCE);
+  std::unique_ptr<WaterField> fixedField = CreateTestField(WATER_SOLVER_FIXED);
+
+  float worst = 0.0f;
+  for (int step = 0; step < TEST_STEPS; step++)
+  {
+    TestSplash(*floatField, step);
+    TestSplash(*fixedField, step);
+    floatField->Step(TEST_STEP_TIME);
+    fixedField->Step(TEST_STEP_TIME);
+    worst = fmaxf(worst, MaxHeightDifference(*floatField, *fixedField));
+  }
+
+  printf("fixed point: largest height difference %f over %d steps, bound %f\n",
+         worst, TEST_STEPS, WATER_FIXED_MAX_ERROR);
+  return worst <= WATER_FIXED_MAX_ERROR ? 0 : 1;
+}
@@ -0,0 +1,61 @@
+/*
+ *  Copyright (C) 2005-2021 Team Kodi (https://kodi.tv)
+ *
+ *  SPDX-License-Identifier: GPL-2.0-or-later
+ *  See LICENSE.md for more information.
+ */
+
+#pragma once
+
+// Helpers shared by the water solver tests. The fields run without a
+// renderer, on the default settings of the addon.
+
+#include "waterfield.h"
+#include "watersolver.h"
+
+#include <math.h>
+#include <memory>
+#include <stdint.h>
+
+#define TEST_XDIVS 150
+#define TEST_YDIVS 150
+#define TEST_STEP_TIME (1.0f/60.0f)
+// Steps between two splashes
+#define TEST_SPLASH_STEPS 20
+
+inline std::unique_ptr<WaterField> CreateTestField(int solver)
+{
+  std::unique_ptr<WaterField> field(new WaterField(nullptr, -10.0f, 10.0f, -10.0f, 10.0f,
+                                                   TEST_XDIVS, TEST_YDIVS, 0.0f, 0.5f, 0.05f,
+                                                   1.0f, 0.04f, false));
+  field->SetSolver(solver);
+  return field;
+}
+
+// Drops a splash like the rain effect does every TEST_SPLASH_STEPS
+// steps. The splashes only depend on step, so fields stepped alongside
+// each other get the same ones.
+inline void TestSplash(WaterField& field, int step)
+{
+  if (step % TEST_SPLASH_STEPS != 0)
+    return;
+  uint32_t seed = (uint32_t)step * 2654435761u + 1;
+  auto next = [&seed]() {
+    seed = seed * 1664525u + 1013904223u;
+    return (seed >> 8) / (float)(1 << 24);
+  };
+  const float x = field.xMin() + next() * (field.xMax() - field.xMin());
+  const float y = field.yMin() + next() * (field.yMax() - field.yMin());
+  const float spread = 0.5f + 0.5f * next();
+  const float height = -2.0f - 2.0f * next();
+  field.SetHeight(x, y, spread, height, CRGBA(0x80, 0x80, 0x80, 0xFF));
+}
+
+inline float MaxHeightDifference(WaterField& a, WaterField& b)
+{
+  float difference = 0.0f;
+  for (int i = 0; i < a.XDivs(); i++)
+    for (int j = 0; j < a.YDivs(); j++)
+      difference = fmaxf(difference, fabsf(a.Height(i,j) - b.Height(i,j)));
+  return difference;
+}